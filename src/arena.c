@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_CHUNK (64 << 10)
+#define ARENA_ALIGN 16
+
+void *arena_alloc(Arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *c = a->head;
+    if (!c || c->size - c->used < n) {
+        if (a->spare && a->spare->size >= n) {
+            c = a->spare;
+            a->spare = NULL;
+        } else {
+            size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+            c = malloc(sizeof(ArenaChunk) + size);
+            if (!c) abort();
+            c->size = size;
+        }
+        c->used = 0;
+        c->prev = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    return a->last = p;
+}
+
+/* p must have been allocated from a with size old */
+void *arena_grow(Arena *a, void *p, size_t old, size_t n) {
+    ArenaChunk *c = a->head;
+    if (p && p == a->last) {
+        size_t start = (char *)p - c->data;
+        if (c->size - start >= n) {
+            c->used = start + ((n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+            return p;
+        }
+    }
+    void *q = arena_alloc(a, n);
+    if (p) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = 0;
+    return p;
+}
+
+ArenaMark arena_mark(const Arena *a) {
+    return (ArenaMark){a->head, a->head ? a->head->used : 0};
+}
+
+void arena_release(Arena *a, ArenaMark m) {
+    while (a->head && a->head != m.chunk) {
+        ArenaChunk *c = a->head;
+        a->head = c->prev;
+        if (a->spare && a->spare->size >= c->size) free(c);
+        else {
+            free(a->spare);
+            a->spare = c;
+        }
+    }
+    if (a->head) a->head->used = m.used;
+    a->last = NULL;
+}
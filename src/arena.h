@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator. Allocations are never freed one by one; a mark taken
+ * earlier releases everything allocated after it in one go.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+    size_t size, used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+    ArenaChunk *spare;      /* last released chunk, kept to avoid malloc churn at a boundary */
+    void *last;             /* most recent allocation, which arena_grow() can extend in place */
+} Arena;
+
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+void *arena_alloc(Arena *a, size_t n);
+void *arena_grow(Arena *a, void *p, size_t old, size_t n);
+char *arena_strndup(Arena *a, const char *s, size_t n);
+ArenaMark arena_mark(const Arena *a);
+void arena_release(Arena *a, ArenaMark m);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bfc.h"
+
+/*
+ * x86-64 assembly backend (GAS, AT&T syntax) for Linux. The program does
+ * its own buffered I/O through read/write syscalls, so the output only needs
+ * `as` and `ld`. Registers:
+ *   rbx = tape, r12 = &tape[ptr], r13d = vsp, r14 = vstack, r15d = psp, rbp = pstack
+ * The runtime routines below only clobber rax, rcx, rdx, rsi, rdi, r8-r11.
+ * The tape is mapped at startup between PROT_NONE guards, like the C
+ * backend's; bf_fault reports a fault inside that reservation as a tape
+ * access out of range and leaves any other to the default action.
+ */
+
+static const char *asm_runtime =
+    "bf_flush:\n"
+    "    mov olen(%rip), %rdx\n"
+    "    lea obuf(%rip), %rsi\n"
+    "1:  test %rdx, %rdx\n"
+    "    jz 2f\n"
+    "    mov $1, %eax\n"
+    "    mov $1, %edi\n"
+    "    syscall\n"
+    "    test %rax, %rax\n"
+    "    jle 2f\n"
+    "    add %rax, %rsi\n"
+    "    sub %rax, %rdx\n"
+    "    jmp 1b\n"
+    "2:  movq $0, olen(%rip)\n"
+    "    ret\n\n"
+    "bf_out:\n"
+    "    mov olen(%rip), %rcx\n"
+    "    lea obuf(%rip), %rdx\n"
+    "    mov %al, (%rdx,%rcx)\n"
+    "    inc %rcx\n"
+    "    mov %rcx, olen(%rip)\n"
+    "    cmp $IOBUF, %rcx\n"
+    "    je bf_flush\n"
+    "    ret\n\n"
+    "bf_outs:\n"
+    "    mov %rsi, %r8\n"
+    "    mov %edx, %r9d\n"
+    "1:  test %r9d, %r9d\n"
+    "    jz 2f\n"
+    "    movzbl (%r8), %eax\n"
+    "    call bf_out\n"
+    "    inc %r8\n"
+    "    dec %r9d\n"
+    "    jmp 1b\n"
+    "2:  ret\n\n"
+    "bf_in:\n"
+    "    mov ipos(%rip), %rcx\n"
+    "    cmp ilen(%rip), %rcx\n"
+    "    jb 1f\n"
+    "    call bf_flush\n"
+    "    xor %eax, %eax\n"
+    "    xor %edi, %edi\n"
+    "    lea ibuf(%rip), %rsi\n"
+    "    mov $IOBUF, %edx\n"
+    "    syscall\n"
+    "    test %rax, %rax\n"
+    "    jle 2f\n"
+    "    mov %rax, ilen(%rip)\n"
+    "    xor %ecx, %ecx\n"
+    "1:  lea ibuf(%rip), %rdx\n"
+    "    movzbl (%rdx,%rcx), %eax\n"
+    "    inc %rcx\n"
+    "    mov %rcx, ipos(%rip)\n"
+    "    ret\n"
+    "2:  mov $-1, %eax\n"
+    "    ret\n\n"
+    /* rsi = length, edx = protection; anonymous mapping in rax */
+    "bf_map:\n"
+    "    mov $9, %eax\n"
+    "    xor %edi, %edi\n"
+    "    mov $0x4022, %r10d\n"
+    "    mov $-1, %r8\n"
+    "    xor %r9d, %r9d\n"
+    "    syscall\n"
+    "    cmp $-4096, %rax\n"
+    "    ja bf_nomem\n"
+    "    ret\n\n"
+    "bf_nomem:\n"
+    "    lea nomem(%rip), %rsi\n"
+    "    mov $20, %edx\n"
+    "    jmp bf_die\n"
+    /* rsi = siginfo, si_addr at 16 */
+    "bf_fault:\n"
+    "    mov 16(%rsi), %rax\n"
+    "    sub tape_lo(%rip), %rax\n"
+    "    movabs $TAPE*CELL+2*GUARD, %rcx\n"
+    "    cmp %rcx, %rax\n"
+    "    jae 1f\n"
+    "    call bf_flush\n"
+    "    lea range(%rip), %rsi\n"
+    "    mov $25, %edx\n"
+    "bf_die:\n"
+    "    mov $1, %eax\n"
+    "    mov $2, %edi\n"
+    "    syscall\n"
+    "    mov $60, %eax\n"
+    "    mov $1, %edi\n"
+    "    syscall\n"
+    /* not ours: back to SIG_DFL, and the faulting instruction runs again */
+    "1:  mov $13, %eax\n"
+    "    mov $11, %edi\n"
+    "    lea sigdfl(%rip), %rsi\n"
+    "    xor %edx, %edx\n"
+    "    mov $8, %r10d\n"
+    "    syscall\n"
+    "    ret\n"
+    "bf_sigreturn:\n"
+    "    mov $15, %eax\n"
+    "    syscall\n\n"
+    /* rdi = start, esi = stride; SSE2 for +-1 like rt_scan() */
+    "bf_scan:\n"
+    "    mov %rdi, %rax\n"
+    "    movslq %esi, %rsi\n"
+    "    pxor %xmm0, %xmm0\n"
+    "    cmp $1, %rsi\n"
+    "    jne 4f\n"
+    "    lea TAPE(%rbx), %rdx\n"
+    "1:  lea 16(%rax), %rcx\n"
+    "    cmp %rdx, %rcx\n"
+    "    ja 7f\n"
+    "    movdqu (%rax), %xmm1\n"
+    "    pcmpeqb %xmm0, %xmm1\n"
+    "    pmovmskb %xmm1, %ecx\n"
+    "    test %ecx, %ecx\n"
+    "    jnz 2f\n"
+    "    add $16, %rax\n"
+    "    jmp 1b\n"
+    "2:  bsf %ecx, %ecx\n"
+    "    add %rcx, %rax\n"
+    "    ret\n"
+    "4:  cmp $-1, %rsi\n"
+    "    jne 7f\n"
+    "    lea 15(%rbx), %rdx\n"
+    "5:  cmp %rdx, %rax\n"
+    "    jb 7f\n"
+    "    movdqu -15(%rax), %xmm1\n"
+    "    pcmpeqb %xmm0, %xmm1\n"
+    "    pmovmskb %xmm1, %ecx\n"
+    "    test %ecx, %ecx\n"
+    "    jnz 6f\n"
+    "    sub $16, %rax\n"
+    "    jmp 5b\n"
+    "6:  bsr %ecx, %ecx\n"
+    "    lea -15(%rax,%rcx), %rax\n"
+    "    ret\n"
+    "7:  cmpb $0, (%rax)\n"
+    "    je 8f\n"
+    "    add %rsi, %rax\n"
+    "    jmp 7b\n"
+    "8:  ret\n\n";
+
+static void put_bytes(FILE *out, const char *label, const uint8_t *s, int n) {
+    fprintf(out, "%s:", label);
+    for (int i = 0; i < n; i++) fprintf(out, "%s%u", i % 32 ? "," : "\n    .byte ", s[i]);
+    fprintf(out, "\n");
+}
+
+static void put_cells(FILE *out, const char *label, const void *cells, int n) {
+    const char *directive = cell_bits == 8 ? ".byte" : cell_bits == 16 ? ".short" : ".long";
+    fprintf(out, "%s:", label);
+    for (int i = 0; i < n; i++) {
+        if (i % 32) fprintf(out, ",%u", cell_get(cells, i));
+        else fprintf(out, "\n    %s %u", directive, cell_get(cells, i));
+    }
+    fprintf(out, "\n");
+}
+
+/* eax *= f for f > 0, with shifts and lea where they beat imul */
+static void scale(FILE *out, int f) {
+    switch (f) {
+        case 1: break;
+        case 2: fprintf(out, "    add %%eax, %%eax\n"); break;
+        case 3: fprintf(out, "    lea (%%rax,%%rax,2), %%eax\n"); break;
+        case 4: fprintf(out, "    shl $2, %%eax\n"); break;
+        case 5: fprintf(out, "    lea (%%rax,%%rax,4), %%eax\n"); break;
+        case 8: fprintf(out, "    shl $3, %%eax\n"); break;
+        case 9: fprintf(out, "    lea (%%rax,%%rax,8), %%eax\n"); break;
+        default: fprintf(out, "    imul $%d, %%eax, %%eax\n", f);
+    }
+}
+
+void generate_asm(FILE *out, int bufsize, const Machine *start) {
+    int pc = start ? start->pc : 0, first = resume_first(pc), used = 0, uses_outs = 0;
+    int *loops = malloc(sizeof(int) * (ir_len + 1)), depth = 0;
+    uint32_t vsp = start ? start->vsp : 0, psp = start ? start->psp : 0;
+    if (start) for (uint32_t i = 0; i < tape_size; i++) if (cell_get(start->tape, i)) used = i + 1;
+    for (int i = 0; i < ir_len; i++) if (ir[i].type == OP_OUTS) uses_outs = 1;
+
+    /* operand size suffix, register and zero-extending load for a cell */
+    int w = cell_bits == 8 ? 0 : cell_bits == 16 ? 1 : 2, size = CELL_BYTES;
+    char sfx = "bwl"[w];
+    const char *reg = (const char *[]){"%al", "%ax", "%eax"}[w];
+    const char *load = (const char *[]){"movzbl", "movzwl", "movl"}[w];
+
+    fprintf(out, ".set TAPE, %u\n.set CELL, %d\n.set GUARD, %zu\n.set IOBUF, %d\n\n", tape_size, size, tape_guard(), bufsize);
+    fprintf(out, "    .data\n    .balign 16\n");
+    if (start) {
+        fprintf(out, "temp:");
+        for (int i = 0; i < STACK_TEMPS; i++) fprintf(out, "%s%u", i ? "," : "\n    .long ", start->temp[i]);
+        fprintf(out, "\n");
+    } else fprintf(out, "temp: .zero %d\n", 4 * STACK_TEMPS);
+    /* SIGSEGV: handler, SA_SIGINFO | SA_RESTORER, restorer, mask */
+    fprintf(out, "sigact: .quad bf_fault, 0x04000004, bf_sigreturn, 0\n");
+    fprintf(out, "    .section .rodata\n");
+    fprintf(out, "nomem: .ascii \"cannot map the tape\\n\"\nrange: .ascii \"tape access out of range\\n\"\n");
+    if (used) put_cells(out, "tape_init", start->tape, used);
+    if (vsp) put_cells(out, "vstack_init", start->vstack, vsp);
+    if (psp) fprintf(out, "    .balign 4\npstack_init:");
+    for (uint32_t i = 0; i < psp; i++) fprintf(out, "%s%u", i % 16 ? "," : "\n    .long ", start->pstack[i]);
+    if (psp) fprintf(out, "\n");
+    if (uses_outs) put_bytes(out, "pool", str_pool, str_pool_len);
+    if (start && start->out_len) put_bytes(out, "pre", start->out, start->out_len);
+    fprintf(out, "    .bss\n    .balign 16\nobuf: .zero IOBUF\nibuf: .zero IOBUF\nolen: .zero 8\nipos: .zero 8\nilen: .zero 8\n");
+    fprintf(out, "tape_lo: .zero 8\nsigdfl: .zero 32\n\n");
+
+    fprintf(out, "    .text\n");
+    fputs(asm_runtime, out);
+    fprintf(out, "    .globl _start\n_start:\n");
+    /* tape between guards; pstack (4 * TAPE bytes) and vstack in a second mapping */
+    fprintf(out, "    movabs $TAPE*CELL+2*GUARD, %%rsi\n    xor %%edx, %%edx\n    call bf_map\n    mov %%rax, tape_lo(%%rip)\n    movabs $GUARD, %%rbx\n    add %%rax, %%rbx\n");
+    fprintf(out, "    mov $10, %%eax\n    mov %%rbx, %%rdi\n    movabs $TAPE*CELL, %%rsi\n    mov $3, %%edx\n    syscall\n");
+    fprintf(out, "    test %%rax, %%rax\n    jnz bf_nomem\n");
+    fprintf(out, "    movabs $TAPE*(4+CELL), %%rsi\n    mov $3, %%edx\n    call bf_map\n");
+    fprintf(out, "    mov %%rax, %%rbp\n    movabs $TAPE*4, %%r14\n    add %%rax, %%r14\n");
+    if (used) fprintf(out, "    mov %%rbx, %%rdi\n    lea tape_init(%%rip), %%rsi\n    movabs $%d*CELL, %%rcx\n    rep movsb\n", used);
+    if (vsp) fprintf(out, "    mov %%r14, %%rdi\n    lea vstack_init(%%rip), %%rsi\n    movabs $%u*CELL, %%rcx\n    rep movsb\n", vsp);
+    if (psp) fprintf(out, "    mov %%rbp, %%rdi\n    lea pstack_init(%%rip), %%rsi\n    mov $%u, %%ecx\n    rep movsl\n", psp);
+    fprintf(out, "    mov $13, %%eax\n    mov $11, %%edi\n    lea sigact(%%rip), %%rsi\n    xor %%edx, %%edx\n    mov $8, %%r10d\n    syscall\n");
+    fprintf(out, "    movabs $%u*CELL, %%r12\n    add %%rbx, %%r12\n", start ? start->ptr : 0);
+    fprintf(out, "    mov $%u, %%r13d\n    mov $%u, %%r15d\n", vsp, psp);
+    if (start && start->out_len) fprintf(out, "    lea pre(%%rip), %%rsi\n    mov $%d, %%edx\n    call bf_outs\n", start->out_len);
+    if (first < pc) fprintf(out, "    jmp .Lresume\n");
+
+    for (int i = 0; i < first; i++) {
+        if (ir[i].type == OP_JZ || ir[i].type == OP_IF) loops[depth++] = i;
+        else if ((ir[i].type == OP_JNZ || ir[i].type == OP_ENDIF) && depth > 0) depth--;
+    }
+    for (int i = first; i < ir_len; i++) {
+        Instruction inst = ir[i];
+        int f = abs(inst.val2), off = inst.off * size, dst = (inst.off + inst.val) * size;
+        if (i == pc && first < pc) fprintf(out, ".Lresume:\n");
+        switch (inst.type) {
+            case OP_ADD: fprintf(out, "    add%c $%u, %d(%%r12)\n", sfx, (uint32_t)inst.val & cell_mask, off); break;
+            case OP_MOVE: fprintf(out, "    add $%ld, %%r12\n", (long)inst.val * size); break;
+            case OP_OUT: fprintf(out, "    %s %d(%%r12), %%eax\n    call bf_out\n", load, off); break;
+            case OP_OUTS: fprintf(out, "    lea pool+%d(%%rip), %%rsi\n    mov $%d, %%edx\n    call bf_outs\n", inst.val, inst.val2); break;
+            case OP_IN: fprintf(out, "    call bf_in\n    mov %s, %d(%%r12)\n", reg, off); break;
+            case OP_JZ:
+                fprintf(out, "    cmp%c $0, (%%r12)\n    je .Le%d\n.Lb%d:\n", sfx, i, i);
+                loops[depth++] = i;
+                break;
+            case OP_JNZ:
+                if (depth == 0) break;
+                depth--;
+                fprintf(out, "    cmp%c $0, (%%r12)\n    jne .Lb%d\n.Le%d:\n", sfx, loops[depth], loops[depth]);
+                break;
+            case OP_IF:
+                fprintf(out, "    cmp%c $0, %d(%%r12)\n    je .Le%d\n", sfx, off, i);
+                loops[depth++] = i;
+                break;
+            case OP_ENDIF:
+                if (depth == 0) break;
+                fprintf(out, ".Le%d:\n", loops[--depth]);
+                break;
+            case OP_CLEAR: fprintf(out, "    mov%c $0, %d(%%r12)\n", sfx, off); break;
+            case OP_SET: fprintf(out, "    mov%c $%u, %d(%%r12)\n", sfx, (uint32_t)inst.val & cell_mask, off); break;
+            case OP_MUL:
+                fprintf(out, "    %s %d(%%r12), %%eax\n", load, off);
+                scale(out, f);
+                fprintf(out, "    %s%c %s, %d(%%r12)\n", inst.val2 > 0 ? "add" : "sub", sfx, reg, dst);
+                break;
+            case OP_MUL2:
+                fprintf(out, "    %s %d(%%r12), %%eax\n    %s %d(%%r12), %%ecx\n    imul %%ecx, %%eax\n", load, off, load, (inst.off + inst.val3) * size);
+                scale(out, f);
+                fprintf(out, "    %s%c %s, %d(%%r12)\n", inst.val2 > 0 ? "add" : "sub", sfx, reg, dst);
+                break;
+            case OP_SCAN:
+                if (w == 0 && (inst.val == 1 || inst.val == -1)) {
+                    fprintf(out, "    mov %%r12, %%rdi\n    mov $%d, %%esi\n    call bf_scan\n    mov %%rax, %%r12\n", inst.val);
+                } else {
+                    fprintf(out, "1:  cmp%c $0, (%%r12)\n    je 2f\n    add $%ld, %%r12\n    jmp 1b\n2:\n", sfx, (long)inst.val * size);
+                }
+                break;
+            case OP_EXT_PTR_MAX: fprintf(out, "    movabs $(TAPE-1)*CELL, %%r12\n    add %%rbx, %%r12\n"); break;
+            case OP_EXT_PTR_ZERO: fprintf(out, "    mov %%rbx, %%r12\n"); break;
+            case OP_EXT_PUSH_V:
+                if (!inst.val2) fprintf(out, "    cmp $TAPE, %%r13d\n    jae 1f\n");
+                fprintf(out, "    %s (%%r12), %%eax\n    mov %s, (%%r14,%%r13,%d)\n    inc %%r13d\n1:\n", load, reg, size);
+                break;
+            case OP_EXT_POP_V:
+                if (!inst.val2) fprintf(out, "    test %%r13d, %%r13d\n    jz 1f\n");
+                fprintf(out, "    dec %%r13d\n    %s (%%r14,%%r13,%d), %%eax\n    mov %s, (%%r12)\n1:\n", load, size, reg);
+                break;
+            case OP_EXT_PUSH_P:
+                if (!inst.val2) fprintf(out, "    cmp $TAPE, %%r15d\n    jae 1f\n");
+                fprintf(out, "    mov %%r12, %%rax\n    sub %%rbx, %%rax\n");
+                if (w) fprintf(out, "    shr $%d, %%rax\n", w);
+                fprintf(out, "    mov %%eax, (%%rbp,%%r15,4)\n    inc %%r15d\n1:\n");
+                break;
+            case OP_EXT_POP_P:
+                if (!inst.val2) fprintf(out, "    test %%r15d, %%r15d\n    jz 1f\n");
+                fprintf(out, "    dec %%r15d\n    mov (%%rbp,%%r15,4), %%eax\n    lea (%%rbx,%%rax,%d), %%r12\n1:\n", size);
+                break;
+            case OP_SAVE:
+                fprintf(out, "    %s %d(%%r12), %%eax\n    mov %%eax, temp+%d(%%rip)\n", load, off, inst.val * 4);
+                break;
+            case OP_RESTORE:
+                fprintf(out, "    mov temp+%d(%%rip), %%eax\n    mov %s, %d(%%r12)\n", inst.val * 4, reg, off);
+                break;
+            case OP_EXT_CLR_END:
+                fprintf(out, "    movabs $(TAPE-1)*CELL, %%rax\n    add %%rbx, %%rax\n    cmp %%rax, %%r12\n    jne 1f\n    mov%c $0, (%%r12)\n1:\n", sfx);
+                break;
+            case OP_EXT_CLR_BEGIN:
+                fprintf(out, "    cmp %%rbx, %%r12\n    jne 1f\n    mov%c $0, (%%r12)\n1:\n", sfx);
+                break;
+        }
+    }
+    /* unmatched '[' jumps past the end of the program */
+    while (depth > 0) {
+        depth--;
+        if (loops[depth] >= first) fprintf(out, ".Le%d:\n", loops[depth]);
+    }
+    if (pc == ir_len && first < pc) fprintf(out, ".Lresume:\n");
+    fprintf(out, "    call bf_flush\n    mov $60, %%eax\n    xor %%edi, %%edi\n    syscall\n");
+    free(loops);
+}
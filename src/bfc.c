@@ -2,78 +2,154 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-
-#define TAPE_CONST_VAL 65536
-
-typedef enum {
-    OP_ADD, OP_MOVE, OP_OUT, OP_IN, OP_JZ, OP_JNZ,
-    OP_CLEAR, OP_MUL,
-    OP_EXT_PTR_MAX, OP_EXT_PTR_ZERO,
-    OP_EXT_PUSH_V, OP_EXT_POP_V,
-    OP_EXT_PUSH_P, OP_EXT_POP_P,
-    OP_EXT_CLR_END, OP_EXT_CLR_BEGIN
-} OpType;
-
-typedef struct {
-    OpType type;
-    int val;
-    int val2;
-} Instruction;
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include "bfc.h"
+#include "pp.h"
 
 Instruction *ir = NULL;
 int ir_cap = 0;
 int ir_len = 0;
 
+uint32_t tape_size = TAPE_CONST_VAL;
+int cell_bits = 8;
+uint32_t cell_mask = 0xFF;
+
+uint32_t cell_get(const void *cells, uint32_t i) {
+    if (cell_bits == 8) return ((const uint8_t *)cells)[i];
+    if (cell_bits == 16) return ((const uint16_t *)cells)[i];
+    return ((const uint32_t *)cells)[i];
+}
+
+uint8_t *str_pool = NULL;
+int str_pool_len = 0;
+static int str_pool_cap = 0;
+
+int pool_add(const uint8_t *s, int n) {
+    /* s may point into the pool itself */
+    long inside = str_pool && s >= str_pool && s < str_pool + str_pool_len ? s - str_pool : -1;
+    while (str_pool_len + n > str_pool_cap) {
+        str_pool_cap = str_pool_cap == 0 ? 256 : str_pool_cap * 2;
+        str_pool = realloc(str_pool, str_pool_cap);
+    }
+    memcpy(str_pool + str_pool_len, inside >= 0 ? str_pool + inside : s, n);
+    str_pool_len += n;
+    return str_pool_len - n;
+}
+
 void emit(OpType type, int val, int val2) {
     if (ir_len >= ir_cap) {
         ir_cap = ir_cap == 0 ? 1024 : ir_cap * 2;
         ir = realloc(ir, ir_cap * sizeof(Instruction));
     }
-    ir[ir_len++] = (Instruction){type, val, val2};
+    ir[ir_len++] = (Instruction){type, val, val2, 0, 0, prof_origin};
 }
 
+/* runs never merge into instructions below ir_floor (see intrin.c) */
+int ir_floor = 0;
+
 void emit_rle(OpType type, int val) {
-    if (ir_len > 0 && ir[ir_len - 1].type == type) {
-        ir[ir_len - 1].val += val;
+    int sum;
+    if (ir_len > ir_floor && ir[ir_len - 1].type == type && !__builtin_add_overflow(ir[ir_len - 1].val, val, &sum)) {
+        ir[ir_len - 1].val = sum;
         if (ir[ir_len - 1].val == 0) ir_len--;
     } else {
         emit(type, val, 0);
     }
 }
 
-void parse_to_ir(FILE *in) {
-    int c;
-    while ((c = fgetc(in)) != EOF) {
-        if (c == '/') {
-            int next = fgetc(in);
-            if (next == '*') {
-                while (1) {
-                    int nc = fgetc(in);
-                    if (nc == EOF) break;
-                    if (nc == '*') {
-                        int nnc = fgetc(in);
-                        if (nnc == '/') break;
-                        ungetc(nnc, in);
-                    }
+/*
+ * The preprocessor hands over text in arbitrary pieces, so comments and
+ * the two- and three-character EXT ops are tracked across calls. So are
+ * the origin marks pp_annotate() asks for: a comment "@NAME" opens an
+ * intrinsic region and "@" closes it; and the "#..." source locations of
+ * pp_locations(), which go to prof_mark().
+ */
+enum { P_CODE, P_SLASH, P_COMMENT_OPEN, P_COMMENT, P_COMMENT_STAR, P_MARK, P_MARK_STAR, P_LOC, P_LOC_STAR, P_EXT, P_EXT_CLR };
+
+typedef struct {
+    int state;
+    int mark_len;
+    char mark[64];
+    int loc_len;
+    char loc[4096];
+} Lexer;
+
+static void loc_char(Lexer *lx, int c) {
+    if (lx->loc_len < (int)sizeof(lx->loc) - 1) lx->loc[lx->loc_len++] = c;
+}
+
+void parse_chunk(const char *s, size_t n, void *ctx) {
+    Lexer *lx = ctx;
+    int *state = &lx->state;
+    for (size_t i = 0; i < n; i++) {
+        int c = s[i];
+        switch (*state) {
+            case P_SLASH:
+                *state = P_CODE;
+                if (c == '*') { *state = P_COMMENT_OPEN; continue; }
+                break;
+            case P_COMMENT_OPEN:
+                if (c == '@') { *state = P_MARK; lx->mark_len = 0; continue; }
+                if (c == '#') { *state = P_LOC; lx->loc_len = 0; continue; }
+                *state = c == '*' ? P_COMMENT_STAR : P_COMMENT;
+                continue;
+            case P_MARK:
+                if ((isalnum(c) || c == '_') && lx->mark_len < (int)sizeof(lx->mark) - 1) lx->mark[lx->mark_len++] = c;
+                else *state = c == '*' ? P_MARK_STAR : P_COMMENT;
+                continue;
+            case P_MARK_STAR:
+                if (c == '/') {
+                    *state = P_CODE;
+                    lx->mark[lx->mark_len] = 0;
+                    if (lx->mark_len) intrinsic_begin(lx->mark);
+                    else intrinsic_end();
+                } else *state = c == '*' ? P_COMMENT_STAR : P_COMMENT;
+                continue;
+            case P_LOC:
+                if (c == '*') *state = P_LOC_STAR;
+                else loc_char(lx, c);
+                continue;
+            case P_LOC_STAR:
+                if (c == '/') {
+                    *state = P_CODE;
+                    lx->loc[lx->loc_len] = 0;
+                    prof_mark(lx->loc);
+                    continue;
+                }
+                loc_char(lx, '*');
+                if (c != '*') {
+                    *state = P_LOC;
+                    loc_char(lx, c);
                 }
                 continue;
-            } else ungetc(next, in);
-        }
-        if (c == '_') {
-            int next = fgetc(in);
-            if (next == '>') emit(OP_EXT_PTR_MAX, 0, 0);
-            else if (next == '<') emit(OP_EXT_PTR_ZERO, 0, 0);
-            else if (next == '^') emit(OP_EXT_PUSH_V, 0, 0);
-            else if (next == '&') emit(OP_EXT_POP_V, 0, 0);
-            else if (next == '#') emit(OP_EXT_PUSH_P, 0, 0);
-            else if (next == '$') emit(OP_EXT_POP_P, 0, 0);
-            else if (next == '?') {
-                int third = fgetc(in);
-                if (third == '>') emit(OP_EXT_CLR_END, 0, 0);
-                else if (third == '<') emit(OP_EXT_CLR_BEGIN, 0, 0);
-                else { ungetc(third, in); ungetc(next, in); }
-            } else ungetc(next, in);
+            case P_COMMENT:
+                if (c == '*') *state = P_COMMENT_STAR;
+                continue;
+            case P_COMMENT_STAR:
+                if (c == '/') *state = P_CODE;
+                else if (c != '*') *state = P_COMMENT;
+                continue;
+            case P_EXT:
+                *state = P_CODE;
+                if (c == '>') { emit(OP_EXT_PTR_MAX, 0, 0); continue; }
+                if (c == '<') { emit(OP_EXT_PTR_ZERO, 0, 0); continue; }
+                if (c == '^') { emit(OP_EXT_PUSH_V, 0, 0); continue; }
+                if (c == '&') { emit(OP_EXT_POP_V, 0, 0); continue; }
+                if (c == '#') { emit(OP_EXT_PUSH_P, 0, 0); continue; }
+                if (c == '$') { emit(OP_EXT_POP_P, 0, 0); continue; }
+                if (c == '?') { *state = P_EXT_CLR; continue; }
+                break;
+            case P_EXT_CLR:
+                *state = P_CODE;
+                if (c == '>') { emit(OP_EXT_CLR_END, 0, 0); continue; }
+                if (c == '<') { emit(OP_EXT_CLR_BEGIN, 0, 0); continue; }
+                break;
         }
+        if (c == '/') *state = P_SLASH;
+        else if (c == '_') *state = P_EXT;
         else if (c == '+') emit_rle(OP_ADD, 1);
         else if (c == '-') emit_rle(OP_ADD, -1);
         else if (c == '>') emit_rle(OP_MOVE, 1);
@@ -85,129 +161,845 @@ void parse_to_ir(FILE *in) {
     }
 }
 
-void optimize_ir() {
-    Instruction *new_ir = malloc(ir_cap * sizeof(Instruction));
-    int new_len = 0;
+typedef struct {
+    Lexer lex;
+    uint64_t hash;
+} Reader;
+
+/* parse and hash the program for the compile cache in one pass */
+void read_chunk(const char *s, size_t n, void *ctx) {
+    Reader *r = ctx;
+    r->hash = hash_bytes(r->hash, s, n);
+    parse_chunk(s, n, &r->lex);
+}
+
+/*
+ * Reads `bfpp -R` output: ops with an optional repeat count, whitespace
+ * between tokens. Returns 0 on anything else, or on a count past INT_MAX.
+ */
+int parse_rle(const char *s, size_t n) {
+    static const struct { const char *op; OpType type; int val; } ops[] = {
+        {"+", OP_ADD, 1}, {"-", OP_ADD, -1}, {">", OP_MOVE, 1}, {"<", OP_MOVE, -1},
+        {".", OP_OUT, 0}, {",", OP_IN, 0}, {"[", OP_JZ, 0}, {"]", OP_JNZ, 0},
+        {"_>", OP_EXT_PTR_MAX, 0}, {"_<", OP_EXT_PTR_ZERO, 0}, {"_^", OP_EXT_PUSH_V, 0}, {"_&", OP_EXT_POP_V, 0},
+        {"_#", OP_EXT_PUSH_P, 0}, {"_$", OP_EXT_POP_P, 0}, {"_?>", OP_EXT_CLR_END, 0}, {"_?<", OP_EXT_CLR_BEGIN, 0}
+    };
+    size_t i = 0;
+    while (i < n) {
+        if (s[i] == ' ' || s[i] == '\n' || s[i] == '\t' || s[i] == '\r') { i++; continue; }
+        int k = 0, len = 0, nops = sizeof(ops) / sizeof(ops[0]);
+        for (; k < nops; k++) {
+            len = strlen(ops[k].op);
+            if (i + len <= n && memcmp(s + i, ops[k].op, len) == 0) break;
+        }
+        if (k == nops) return 0;
+        i += len;
+        long long count = 0;
+        while (i < n && s[i] >= '0' && s[i] <= '9')
+            if ((count = count * 10 + (s[i++] - '0')) > INT_MAX) return 0;
+        if (count == 0) count = 1;
+        if (ops[k].type == OP_ADD || ops[k].type == OP_MOVE) emit_rle(ops[k].type, ops[k].val * count);
+        else while (count-- > 0) emit(ops[k].type, 0, 0);
+    }
+    return 1;
+}
+
+void write_chunk(const char *s, size_t n, void *ctx) {
+    fwrite(s, 1, n, ctx);
+}
+
+const char *cell(int off) {
+    static char bufs[4][32];
+    static int which = 0;
+    char *buf = bufs[which++ & 3];
+    if (off == 0) return "tape[ptr]";
+    snprintf(buf, sizeof(bufs[0]), "tape[ptr %c %d]", off > 0 ? '+' : '-', abs(off));
+    return buf;
+}
+
+/* same kernels as rt_scan() in rt.c; wide cells only get the plain loop */
+const char *scan_runtime_wide =
+    "uint32_t scan(uint32_t p, int s) {\n"
+    "    while (tape[p]) if ((p += s) >= TAPE) off_tape();\n"
+    "    return p;\n"
+    "}\n\n";
+
+const char *scan_runtime =
+    "uint32_t scan(uint32_t p, int s) {\n"
+    "    if (s == 1) {\n"
+    "        uint8_t *z = memchr(tape + p, 0, TAPE - p);\n"
+    "        if (z) return z - tape;\n"
+    "        p = TAPE - 1;\n"
+    "    }\n"
+    "#ifdef __GLIBC__\n"
+    "    else if (s == -1) {\n"
+    "        uint8_t *z = memrchr(tape, 0, p + 1);\n"
+    "        if (z) return z - tape;\n"
+    "        p = 0;\n"
+    "    }\n"
+    "#endif\n"
+    "#ifdef __SSE2__\n"
+    "    unsigned mask = s == 1 || s == -1 ? 0xFFFF : s == 2 ? 0x5555 : s == -2 ? 0xAAAA : s == 4 ? 0x1111\n"
+    "        : s == -4 ? 0x8888 : s == 8 ? 0x0101 : s == -8 ? 0x8080 : 0;\n"
+    "    if (mask && s > 0) {\n"
+    "        while (p + 16 <= TAPE) {\n"
+    "            __m128i v = _mm_loadu_si128((const __m128i *)(tape + p));\n"
+    "            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & mask;\n"
+    "            if (m) return p + __builtin_ctz(m);\n"
+    "            p += 16;\n"
+    "        }\n"
+    "    } else if (mask) {\n"
+    "        while (p >= 15) {\n"
+    "            __m128i v = _mm_loadu_si128((const __m128i *)(tape + p - 15));\n"
+    "            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & mask;\n"
+    "            if (m) return p - 15 + (31 - __builtin_clz(m));\n"
+    "            p -= 16;\n"
+    "        }\n"
+    "    }\n"
+    "#endif\n"
+    "    while (tape[p]) if ((p += s) >= TAPE) off_tape();\n"
+    "    return p;\n"
+    "}\n\n";
+
+/*
+ * The tape sits between PROT_NONE guard pages in one reservation and is
+ * committed by the kernel as pages are touched. An access that strays into
+ * a guard, or a scan that runs off the tape, is reported after the output
+ * so far is flushed.
+ */
+const char *tape_runtime =
+    "static void off_tape(void) {\n"
+    "    flush();\n"
+    "    write(2, \"tape access out of range\\n\", 25);\n"
+    "    _exit(1);\n"
+    "}\n\n"
+    "static void fault(int sig, siginfo_t *si, void *ctx) {\n"
+    "    uintptr_t at = (uintptr_t)si->si_addr, lo = (uintptr_t)tape - GUARD;\n"
+    "    (void)ctx;\n"
+    "    if (at - lo >= TAPE * sizeof(cell_t) + 2 * (uintptr_t)GUARD) { signal(sig, SIG_DFL); return; }\n"
+    "    off_tape();\n"
+    "}\n\n"
+    "static void map_tape(void) {\n"
+    "    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;\n"
+    "    uint8_t *t = mmap(NULL, TAPE * sizeof(cell_t) + 2 * (size_t)GUARD, PROT_NONE, flags, -1, 0);\n"
+    "    uint8_t *s = mmap(NULL, TAPE * (4 + sizeof(cell_t)), PROT_READ | PROT_WRITE, flags, -1, 0);\n"
+    "    if (t == MAP_FAILED || s == MAP_FAILED || mprotect(t + GUARD, TAPE * sizeof(cell_t), PROT_READ | PROT_WRITE) != 0) {\n"
+    "        write(2, \"cannot map the tape\\n\", 20);\n"
+    "        _exit(1);\n"
+    "    }\n"
+    "    tape = (cell_t *)(t + GUARD);\n"
+    "    pstack = (uint32_t *)s;\n"
+    "    vstack = (cell_t *)(s + TAPE * (size_t)4);\n"
+    "    struct sigaction sa = {0};\n"
+    "    sa.sa_sigaction = fault;\n"
+    "    sa.sa_flags = SA_SIGINFO;\n"
+    "    sigaction(SIGSEGV, &sa, NULL);\n"
+    "}\n\n";
+
+/* same buffering as rt_out()/rt_in() in rt.c */
+const char *io_runtime =
+    "static uint8_t obuf[IOBUF], ibuf[IOBUF];\n"
+    "static size_t olen, ipos, ilen;\n\n"
+    "void flush(void) {\n"
+    "    for (size_t done = 0; done < olen; ) {\n"
+    "        ssize_t n = write(1, obuf + done, olen - done);\n"
+    "        if (n <= 0) break;\n"
+    "        done += n;\n"
+    "    }\n"
+    "    olen = 0;\n"
+    "}\n\n"
+    "void out(uint8_t c) {\n"
+    "    obuf[olen++] = c;\n"
+    "    if (olen == IOBUF) flush();\n"
+    "}\n\n"
+    "void outs(const char *s, size_t n) {\n"
+    "    while (n > 0) {\n"
+    "        size_t k = IOBUF - olen < n ? IOBUF - olen : n;\n"
+    "        memcpy(obuf + olen, s, k);\n"
+    "        olen += k; s += k; n -= k;\n"
+    "        if (olen == IOBUF) flush();\n"
+    "    }\n"
+    "}\n\n"
+    "int in(void) {\n"
+    "    if (ipos == ilen) {\n"
+    "        flush();\n"
+    "        ssize_t n = read(0, ibuf, IOBUF);\n"
+    "        if (n <= 0) return -1;\n"
+    "        ipos = 0;\n"
+    "        ilen = n;\n"
+    "    }\n"
+    "    return ibuf[ipos++];\n"
+    "}\n\n";
+
+/* C string literal for OP_OUTS, octal-escaping everything but plain ASCII */
+void put_string(FILE *out, const uint8_t *s, int n) {
+    fputc('"', out);
+    for (int i = 0; i < n; i++) {
+        if (s[i] == '"' || s[i] == '\\' || s[i] == '?') fprintf(out, "\\%c", s[i]);
+        else if (s[i] >= 32 && s[i] < 127) fputc(s[i], out);
+        else fprintf(out, "\\%03o", s[i]);
+    }
+    fputc('"', out);
+}
+
+/* "decl = {...};" for the first n elements of an array of width-byte integers */
+void put_array(FILE *out, const char *decl, const void *data, int width, int n) {
+    fprintf(out, "%s = {", decl);
+    if (n == 0) fprintf(out, "0");
+    for (int i = 0; i < n; i++) {
+        uint32_t v = width == 1 ? ((const uint8_t *)data)[i] : width == 2 ? ((const uint16_t *)data)[i] : ((const uint32_t *)data)[i];
+        fprintf(out, "%s%u", i == 0 ? "" : i % 32 ? "," : ",\n    ", v);
+    }
+    fprintf(out, "};\n");
+}
+
+/* whether op always touches the tape at the pointer or puts the pointer on it */
+static int anchors_ptr(OpType t) {
+    switch (t) {
+        case OP_MOVE: case OP_OUTS: case OP_ENDIF:
+        case OP_EXT_PUSH_V: case OP_EXT_POP_V: case OP_EXT_PUSH_P: case OP_EXT_POP_P:
+        case OP_EXT_CLR_END: case OP_EXT_CLR_BEGIN:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Guard bytes on each side of the tape, rounded to whole pages: the
+ * farthest any instruction reaches from the pointer, plus the distance the
+ * pointer travels before it next touches the tape so that a long folded
+ * move lands in the guard rather than past it (up to GUARD_MAX), plus some
+ * room.
+ */
+#define GUARD_MAX (1LL << 40)
+
+size_t tape_guard(void) {
+    long long reach = 0, run = 0, travel = 0;
     for (int i = 0; i < ir_len; i++) {
-        if (ir[i].type == OP_JZ) {
-            int j = i + 1, net_move = 0, valid = 1, changes[1024] = {0};
-            while (j < ir_len && ir[j].type != OP_JNZ) {
-                if (ir[j].type == OP_MOVE) net_move += ir[j].val;
-                else if (ir[j].type == OP_ADD) {
-                    if (net_move >= -512 && net_move <= 511) changes[net_move + 512] += ir[j].val;
-                    else { valid = 0; break; }
-                } else { valid = 0; break; }
-                j++;
-            }
-            if (j < ir_len && valid && net_move == 0) {
-                int is_only_self = 1;
-                for (int k = 0; k < 1024; k++) if (k != 512 && changes[k] != 0) is_only_self = 0;
-                
-                if (is_only_self && (changes[512] == -1 || changes[512] == 1)) {
-                    new_ir[new_len++] = (Instruction){OP_CLEAR, 0, 0};
-                    i = j; continue;
-                } else if (changes[512] == -1) {
-                    for (int k = 0; k < 1024; k++) {
-                        if (k != 512 && changes[k] != 0) {
-                            new_ir[new_len++] = (Instruction){OP_MUL, k - 512, changes[k]};
-                        }
-                    }
-                    new_ir[new_len++] = (Instruction){OP_CLEAR, 0, 0};
-                    i = j; continue;
-                }
+        long long r = llabs(ir[i].off);
+        if (ir[i].type == OP_MUL || ir[i].type == OP_MUL2) r += llabs(ir[i].val) + llabs(ir[i].val3);
+        if (r > reach) reach = r;
+        if (ir[i].type == OP_MOVE) run += llabs(ir[i].val);
+        else if (anchors_ptr(ir[i].type)) run = 0;
+        if (run > travel) travel = run;
+    }
+    /* the last access left the pointer within reach of the tape */
+    reach = 2 * reach + travel;
+    reach *= CELL_BYTES;
+    if (reach > GUARD_MAX) reach = GUARD_MAX;
+    return (reach + 65536 + 4095) & ~4095;
+}
+
+/* first instruction still reachable when execution resumes at pc */
+int resume_first(int pc) {
+    int first = pc;
+    for (int i = 0, depth = 0; i < pc; i++) {
+        if (ir[i].type == OP_JZ || ir[i].type == OP_IF) { if (depth++ == 0) first = i; }
+        else if ((ir[i].type == OP_JNZ || ir[i].type == OP_ENDIF) && depth > 0) { if (--depth == 0) first = pc; }
+    }
+    return first;
+}
+
+/*
+ * Large programs are split up so cc never sees one huge function: loops
+ * of at least OUTLINE_LOOP instructions and runs of more than
+ * OUTLINE_CHUNK become functions of their own. They take the tape and the
+ * pointer and return the pointer; the stacks and temporaries stay global.
+ */
+#define OUTLINE_LOOP 256
+#define OUTLINE_CHUNK 2048
+
+/*
+ * With -fprofile-use the outlining stays the same, so the functions match
+ * those cc profiled; what changes is how each is compiled. Functions doing
+ * at least 1/PGO_HOT of the work get the O3 pragma, ones that never ran are
+ * optimized for size, and short inner loops whose trip count never varied
+ * are unrolled that many times.
+ */
+#define PGO_HOT 100
+#define PGO_UNROLL 8
+#define PGO_UNROLL_BODY 16
+
+typedef struct {
+    int ops;            /* instructions written directly, not through a call */
+    uint64_t cost;      /* ops they executed in the profiled run */
+} Weight;
+
+typedef struct {
+    char *text;
+    size_t len;
+    int unit;
+    Weight weight;
+} Outlined;
+
+static Outlined *outlined = NULL;
+static int outlined_len = 0, outlined_cap = 0;
+static LoopTree loops;
+static int profiling;       /* count loop arrivals, iterations and trips in bf_prof[] (profile.c) */
+static const char *prof_file = "bfc.prof";  /* where the profiled program writes them */
+static uint64_t *pgo;       /* loop counts read back by -fprofile-use, NULL for none */
+static uint64_t *pgo_cost, pgo_hot;
+static Weight weight;       /* of the function being written */
+static int resume_at;       /* instruction the resume label goes before, -1 for none */
+static const char *wide;    /* cast for products of cells wider than a byte */
+
+/* the check on an EXT stack op, kept off the straight path */
+static const char *stack_check(Instruction inst, const char *cond) {
+    static char buf[64];
+    if (inst.val2) return "";
+    snprintf(buf, sizeof(buf), "if (__builtin_expect(%s, 1)) ", cond);
+    return buf;
+}
+
+/* times to unroll the loop at i from its profiled trip count, 0 to leave it to cc */
+static int unroll(int i) {
+    int id = loops.at[i];
+    if (!pgo || loops.loop[id].child >= 0 || loops.loop[id].end - i > PGO_UNROLL_BODY) return 0;
+    uint64_t n = prof_trip(pgo, id);
+    return n >= 2 && n <= PGO_UNROLL ? (int)n : 0;
+}
+
+static void put_inst(FILE *out, int i) {
+    Instruction inst = ir[i];
+    int counted = profiling && loop_end(&loops, i) >= 0, id = loops.at[i];
+    int times = inst.type == OP_JZ && id >= 0 ? unroll(i) : 0;
+    weight.ops++;
+    if (pgo_cost) weight.cost += pgo_cost[i + 1] - pgo_cost[i];
+    if (i == resume_at) fprintf(out, "resume: ;\n");
+    if (counted) fprintf(out, "    bf_prof[%d]++;\n", 3 * id);
+    if (counted && inst.type == OP_JZ) fprintf(out, "    uint64_t trip%d = bf_prof[%d];\n", id, 3 * id + 1);
+    if (times) fprintf(out, "#pragma GCC unroll %d\n", times);
+    switch (inst.type) {
+        case OP_ADD: fprintf(out, "    %s %c= %d;\n", cell(inst.off), inst.val > 0 ? '+' : '-', abs(inst.val)); break;
+        case OP_MOVE: fprintf(out, "    ptr %c= %d;\n", inst.val > 0 ? '+' : '-', abs(inst.val)); break;
+        case OP_OUT: fprintf(out, "    out(%s);\n", cell(inst.off)); break;
+        case OP_IN:  fprintf(out, "    %s = in();\n", cell(inst.off)); break;
+        case OP_OUTS:
+            fprintf(out, "    outs(");
+            put_string(out, str_pool + inst.val, inst.val2);
+            fprintf(out, ", %d);\n", inst.val2);
+            break;
+        case OP_JZ:  fprintf(out, "    while(tape[ptr]) {\n"); break;
+        case OP_JNZ: fprintf(out, "    }\n"); break;
+        case OP_CLEAR: fprintf(out, "    %s = 0;\n", cell(inst.off)); break;
+        case OP_SET: fprintf(out, "    %s = %d;\n", cell(inst.off), inst.val); break;
+        case OP_MUL: 
+            if (abs(inst.val2) == 1) {
+                fprintf(out, "    %s %c= %s;\n", cell(inst.off + inst.val), inst.val2 > 0 ? '+' : '-', cell(inst.off));
+            } else {
+                fprintf(out, "    %s %c= %s%s * %d;\n", cell(inst.off + inst.val), inst.val2 > 0 ? '+' : '-', wide, cell(inst.off), abs(inst.val2));
             }
+            break;
+        case OP_MUL2:
+            fprintf(out, "    %s %c= %s%s * %s", cell(inst.off + inst.val), inst.val2 > 0 ? '+' : '-', wide, cell(inst.off), cell(inst.off + inst.val3));
+            if (abs(inst.val2) != 1) fprintf(out, " * %d", abs(inst.val2));
+            fprintf(out, ";\n");
+            break;
+        case OP_IF: fprintf(out, "    if (%s) {\n", cell(inst.off)); break;
+        case OP_ENDIF: fprintf(out, "    }\n"); break;
+        case OP_SCAN: fprintf(out, "    ptr = scan(ptr, %d);\n", inst.val); break;
+        case OP_EXT_PTR_MAX: fprintf(out, "    ptr = TAPE - 1;\n"); break;
+        case OP_EXT_PTR_ZERO: fprintf(out, "    ptr = 0;\n"); break;
+        case OP_EXT_PUSH_V: fprintf(out, "    %svstack[vsp++] = tape[ptr];\n", stack_check(inst, "vsp < TAPE")); break;
+        case OP_EXT_POP_V: fprintf(out, "    %stape[ptr] = vstack[--vsp];\n", stack_check(inst, "vsp > 0")); break;
+        case OP_EXT_PUSH_P: fprintf(out, "    %spstack[psp++] = ptr;\n", stack_check(inst, "psp < TAPE")); break;
+        case OP_EXT_POP_P: fprintf(out, "    %sptr = pstack[--psp];\n", stack_check(inst, "psp > 0")); break;
+        case OP_EXT_CLR_END: fprintf(out, "    if (ptr == TAPE - 1) tape[ptr] = 0;\n"); break;
+        case OP_EXT_CLR_BEGIN: fprintf(out, "    if (ptr == 0) tape[ptr] = 0;\n"); break;
+        case OP_SAVE: fprintf(out, "    temp[%d] = %s;\n", inst.val, cell(inst.off)); break;
+        case OP_RESTORE: fprintf(out, "    %s = temp[%d];\n", cell(inst.off), inst.val); break;
+    }
+    if (counted) fprintf(out, "    bf_prof[%d]++;\n", 3 * id + 1);
+    /* add up the square of the trip count, see prof_trip() */
+    if (profiling && inst.type == OP_JNZ && id >= 0) {
+        fprintf(out, "    trip%d = bf_prof[%d] - trip%d;\n", id, 3 * id + 1, id);
+        fprintf(out, "    bf_prof[%d] += trip%d * trip%d;\n", 3 * id + 2, id, id);
+    }
+}
+
+/* index past the instruction at i, or past the whole loop it opens */
+static int skip_loop(int i) {
+    int end = loop_end(&loops, i);
+    return end >= 0 ? end + 1 : i + 1;
+}
+
+/* the resume label can only be reached from main */
+static int holds_resume(int a, int b) {
+    return resume_at >= a && resume_at < b;
+}
+
+static int outline(int a, int b);
+
+/* ir[a..b), a balanced run; with split set long runs are cut into chunks */
+static void put_run(FILE *out, int a, int b, int split) {
+    if (split && b - a > OUTLINE_CHUNK) {
+        for (int i = a, j; i < b; i = j) {
+            for (j = i; j < b && j - i < OUTLINE_CHUNK; j = skip_loop(j)) ;
+            if (skip_loop(i) == j || holds_resume(i, j)) put_run(out, i, j, 0);
+            else fprintf(out, "    ptr = bf%d(tape, ptr);\n", outline(i, j));
         }
-        new_ir[new_len++] = ir[i];
+        return;
+    }
+    for (int i = a; i < b; ) {
+        int end = loop_end(&loops, i);
+        if (end < 0 || end >= b) { put_inst(out, i++); continue; }
+        if (end + 1 - i >= OUTLINE_LOOP && !holds_resume(i, end + 1)) {
+            fprintf(out, "    ptr = bf%d(tape, ptr);\n", outline(i, end + 1));
+        } else {
+            put_inst(out, i);
+            put_run(out, i + 1, end, 1);
+            put_inst(out, end);
+        }
+        i = end + 1;
     }
-    free(ir); 
-    ir = new_ir; 
-    ir_len = new_len;
 }
 
-void generate_c(FILE *out, int optimize) {
-    if (optimize) fprintf(out, "#pragma GCC optimize(\"O3,unroll-loops\")\n");
-    fprintf(out, "#include <stdio.h>\n#include <stdint.h>\n\n");
-    fprintf(out, "#define TAPE %d\nuint8_t tape[TAPE] = {0};\nuint8_t vstack[TAPE];\nuint32_t pstack[TAPE];\nuint32_t ptr = 0, vsp = 0, psp = 0;\n\n", TAPE_CONST_VAL);
-    fprintf(out, "int main(void) {\n");
-    
-    for (int i = 0; i < ir_len; i++) {
-        Instruction inst = ir[i];
-        switch (inst.type) {
-            case OP_ADD: fprintf(out, "    tape[ptr] %c= %d;\n", inst.val > 0 ? '+' : '-', abs(inst.val)); break;
-            case OP_MOVE: fprintf(out, "    ptr %c= %d;\n", inst.val > 0 ? '+' : '-', abs(inst.val)); break;
-            case OP_OUT: fprintf(out, "    putchar(tape[ptr]);\n"); break;
-            case OP_IN:  fprintf(out, "    tape[ptr] = getchar();\n"); break;
-            case OP_JZ:  fprintf(out, "    while(tape[ptr]) {\n"); break;
-            case OP_JNZ: fprintf(out, "    }\n"); break;
-            case OP_CLEAR: fprintf(out, "    tape[ptr] = 0;\n"); break;
-            case OP_MUL: 
-                if (abs(inst.val2) == 1) {
-                    fprintf(out, "    tape[ptr %c %d] %c= tape[ptr];\n", inst.val > 0 ? '+' : '-', abs(inst.val), inst.val2 > 0 ? '+' : '-');
-                } else {
-                    fprintf(out, "    tape[ptr %c %d] %c= tape[ptr] * %d;\n", inst.val > 0 ? '+' : '-', abs(inst.val), inst.val2 > 0 ? '+' : '-', abs(inst.val2));
-                }
-                break;
-            case OP_EXT_PTR_MAX: fprintf(out, "    ptr = TAPE - 1;\n"); break;
-            case OP_EXT_PTR_ZERO: fprintf(out, "    ptr = 0;\n"); break;
-            case OP_EXT_PUSH_V: fprintf(out, "    if (vsp < TAPE) vstack[vsp++] = tape[ptr];\n"); break;
-            case OP_EXT_POP_V: fprintf(out, "    if (vsp > 0) tape[ptr] = vstack[--vsp];\n"); break;
-            case OP_EXT_PUSH_P: fprintf(out, "    if (psp < TAPE) pstack[psp++] = ptr;\n"); break;
-            case OP_EXT_POP_P: fprintf(out, "    if (psp > 0) ptr = pstack[--psp];\n"); break;
-            case OP_EXT_CLR_END: fprintf(out, "    if (ptr == TAPE - 1) tape[ptr] = 0;\n"); break;
-            case OP_EXT_CLR_BEGIN: fprintf(out, "    if (ptr == 0) tape[ptr] = 0;\n"); break;
+/* move ir[a..b), a single loop or a chunk, into function bfN and return N */
+static int outline(int a, int b) {
+    if (outlined_len == outlined_cap) {
+        outlined_cap = outlined_cap ? outlined_cap * 2 : 16;
+        outlined = realloc(outlined, sizeof(Outlined) * outlined_cap);
+    }
+    int id = outlined_len++;
+    char *text;
+    size_t len;
+    Weight caller = weight;
+    weight = (Weight){0, 0};
+    FILE *f = open_memstream(&text, &len);
+    fprintf(f, "intptr_t bf%d(cell_t *restrict tape, intptr_t ptr) {\n", id);
+    if (skip_loop(a) == b) {
+        put_inst(f, a);
+        put_run(f, a + 1, b - 1, 1);
+        put_inst(f, b - 1);
+    } else {
+        put_run(f, a, b, 0);
+    }
+    fprintf(f, "    return ptr;\n}\n\n");
+    fclose(f);
+    outlined[id] = (Outlined){text, len, 0, weight};
+    weight = caller;
+    return id;
+}
+
+/*
+ * Before a function: with a profile, a hot one is compiled like all code
+ * is at -O3 without one, and one that never ran is marked cold. Returns
+ * whether the options must be popped after it.
+ */
+static int put_weight(FILE *out, Weight w, int optimize) {
+    if (!pgo) return 0;
+    int hot = w.cost >= pgo_hot;
+    if (hot && optimize) fprintf(out, "#pragma GCC push_options\n#pragma GCC optimize(\"O3,unroll-loops\")\n");
+    if (hot || w.cost == 0) fprintf(out, "__attribute__((%s))\n", hot ? "hot" : "cold");
+    return hot && optimize;
+}
+
+/*
+ * With start set, the program is resumed from a state precomputed by
+ * interp_prefix(): its output is printed up front, the tape and stacks are
+ * copied in from initialized data, and main jumps straight to start->pc.
+ * Code before the outermost loop around that point can never run again and
+ * is left out.
+ *
+ * The program is written as up to units translation units, out[0] holding
+ * main and the runtime; outlined functions go to the least loaded unit.
+ * Returns the number of units used.
+ */
+int generate_c(FILE **out, int units, int optimize, int bufsize, const Machine *start) {
+    int uses_scan = 0, uses_temp = 0;
+    for (int i = 0; i < ir_len; i++) if (ir[i].type == OP_SCAN) uses_scan = 1;
+    for (int i = 0; i < ir_len; i++) if (ir[i].type == OP_SAVE) uses_temp = 1;
+
+    int pc = start ? start->pc : 0, first = resume_first(pc), used = 0;
+    if (start) for (uint32_t i = 0; i < tape_size; i++) if (cell_get(start->tape, i)) used = i + 1;
+
+    /* products of 16-bit cells promoted to int could overflow */
+    wide = cell_bits > 8 ? "(uint32_t)" : "";
+    resume_at = first < pc ? pc : -1;
+    loop_tree(&loops);
+    if (pgo) {
+        pgo_cost = prof_costs(&loops, pgo);
+        pgo_hot = pgo_cost[ir_len] / PGO_HOT + 1;
+    }
+
+    char *body;
+    size_t body_len;
+    weight = (Weight){0, 0};
+    FILE *f = open_memstream(&body, &body_len);
+    put_run(f, first, ir_len, 1);
+    fclose(f);
+    Weight main_weight = weight;
+
+    /*
+     * greedy split by instruction count, which the profiling counters do
+     * not change; main and the runtime stay in unit 0
+     */
+    if (outlined_len + 1 < units) units = outlined_len + 1;
+    long *load = calloc(units, sizeof(long));
+    load[0] = main_weight.ops + 512;
+    for (int k = 0; k < outlined_len; k++) {
+        int u = 0;
+        for (int j = 1; j < units; j++) if (load[j] < load[u]) u = j;
+        outlined[k].unit = u;
+        load[u] += outlined[k].weight.ops;
+    }
+    free(load);
+
+    for (int u = 0; u < units; u++) {
+        if (optimize && !pgo) fprintf(out[u], "#pragma GCC optimize(\"O3,unroll-loops\")\n");
+        if (uses_scan && u == 0) fprintf(out[u], "#define _GNU_SOURCE\n");
+        if (profiling && u == 0) fprintf(out[u], "#include <stdio.h>\n#include <stdlib.h>\n");
+        fprintf(out[u], "#include <stdint.h>\n#include <string.h>\n#include <signal.h>\n#include <unistd.h>\n#include <sys/mman.h>\n");
+        if (uses_scan && u == 0) fprintf(out[u], "#ifdef __SSE2__\n#include <emmintrin.h>\n#endif\n");
+        if (u == 0) fprintf(out[u], "\n#ifndef IOBUF\n#define IOBUF %d\n#endif\n", bufsize);
+        fprintf(out[u], "#define TAPE %u\n", tape_size);
+        if (u == 0) fprintf(out[u], "#define GUARD %zu\n", tape_guard());
+        fprintf(out[u], "typedef uint%d_t cell_t;\n", cell_bits);
+        if (u > 0) {
+            fprintf(out[u], "extern cell_t *vstack;\nextern uint32_t *pstack;\nextern uint32_t vsp, psp;\n");
+            if (uses_temp) fprintf(out[u], "extern cell_t temp[%d];\n", STACK_TEMPS);
+            fprintf(out[u], "void out(uint8_t c);\nvoid outs(const char *s, size_t n);\nint in(void);\n");
+            if (uses_scan) fprintf(out[u], "uint32_t scan(uint32_t p, int s);\n");
         }
+        if (profiling) fprintf(out[u], "extern uint64_t bf_prof[];\n");
     }
-    fprintf(out, "    return 0;\n}\n");
+
+    fprintf(out[0], "cell_t *tape, *vstack;\nuint32_t *pstack;\n");
+    if (start) {
+        if (used) put_array(out[0], "static const cell_t tape_init[]", start->tape, CELL_BYTES, used);
+        if (start->vsp) put_array(out[0], "static const cell_t vstack_init[]", start->vstack, CELL_BYTES, start->vsp);
+        if (start->psp) put_array(out[0], "static const uint32_t pstack_init[]", start->pstack, 4, start->psp);
+        fprintf(out[0], "intptr_t ptr = %u;\nuint32_t vsp = %u, psp = %u;\n\n", start->ptr, start->vsp, start->psp);
+    } else {
+        fprintf(out[0], "intptr_t ptr = 0;\nuint32_t vsp = 0, psp = 0;\n\n");
+    }
+    /* outlined code shares the temporaries, otherwise they are locals of main */
+    char decl[32];
+    snprintf(decl, sizeof(decl), "%scell_t temp[%d]", outlined_len ? "" : "    ", STACK_TEMPS);
+    if (uses_temp && outlined_len) put_array(out[0], decl, start ? start->temp : NULL, 4, start ? STACK_TEMPS : 0);
+    fputs(io_runtime, out[0]);
+    fputs(tape_runtime, out[0]);
+    if (uses_scan) fputs(cell_bits == 8 ? scan_runtime : scan_runtime_wide, out[0]);
+
+    for (int u = 0; u < units; u++) {
+        for (int k = 0; k < outlined_len; k++) fprintf(out[u], "intptr_t bf%d(cell_t *restrict tape, intptr_t ptr);\n", k);
+        if (outlined_len) fprintf(out[u], "\n");
+    }
+    for (int k = 0; k < outlined_len; k++) {
+        FILE *o = out[outlined[k].unit];
+        int pushed = put_weight(o, outlined[k].weight, optimize);
+        fwrite(outlined[k].text, 1, outlined[k].len, o);
+        if (pushed) fprintf(o, "#pragma GCC pop_options\n\n");
+        free(outlined[k].text);
+    }
+
+    int pushed = put_weight(out[0], main_weight, optimize);
+    fprintf(out[0], "int main(void) {\n    map_tape();\n");
+    if (start && used) fprintf(out[0], "    memcpy(tape, tape_init, sizeof(tape_init));\n");
+    if (start && start->vsp) fprintf(out[0], "    memcpy(vstack, vstack_init, sizeof(vstack_init));\n");
+    if (start && start->psp) fprintf(out[0], "    memcpy(pstack, pstack_init, sizeof(pstack_init));\n");
+    if (uses_temp && !outlined_len) put_array(out[0], decl, start ? start->temp : NULL, 4, start ? STACK_TEMPS : 0);
+    for (int i = 0; start && i < start->out_len; i += 4096) {
+        int n = start->out_len - i < 4096 ? start->out_len - i : 4096;
+        fprintf(out[0], "    outs(");
+        put_string(out[0], start->out + i, n);
+        fprintf(out[0], ", %d);\n", n);
+    }
+    if (first < pc) fprintf(out[0], "    goto resume;\n");
+    fwrite(body, 1, body_len, out[0]);
+    if (pc == ir_len && first < pc) fprintf(out[0], "resume: ;\n");
+    fprintf(out[0], "    flush();\n    return 0;\n}\n");
+    if (pushed) fprintf(out[0], "#pragma GCC pop_options\n");
+    /* last, so everything before it is laid out as in the build that uses the profile */
+    if (profiling) {
+        fprintf(out[0], "\n");
+        prof_put_runtime(out[0], loops.len, prof_file);
+    }
+
+    free(body);
+    free(pgo_cost);
+    pgo_cost = NULL;
+    loop_tree_free(&loops);
+    outlined_len = 0;
+    return units;
+}
+
+#define JOBS_MAX 64
+#define TMP_C "/tmp/bfc_temp_XXXXXX.c"
+
+/*
+ * compile the units side by side with cc -c, then link them; 0 on success.
+ * With named set unit N is compiled as bfc-unitN, wherever its source is,
+ * so cc's profile data for it is found again in the next build.
+ */
+static int compile_units(char (*src)[sizeof(TMP_C)], int units, const char *opt, int named, const char *output) {
+    char obj[JOBS_MAX][sizeof(TMP_C)], cmd[8192];
+    int failed = 0, len = snprintf(cmd, sizeof(cmd), "cc %s", opt);
+    for (int u = 0; u < units; u++) {
+        snprintf(obj[u], sizeof(obj[u]), "%.*so", (int)sizeof(TMP_C) - 3, src[u]);
+        len += snprintf(cmd + len, sizeof(cmd) - len, " \"%s\"", obj[u]);
+        if (fork() == 0) {
+            char cc[4096], base[32] = "";
+            if (named) snprintf(base, sizeof(base), " -dumpbase bfc-unit%d", u);
+            snprintf(cc, sizeof(cc), "cc %s%s -c \"%s\" -o \"%s\"", opt, base, src[u], obj[u]);
+            _exit(system(cc) == 0 ? 0 : 1);
+        }
+    }
+    for (int u = 0, status; u < units; u++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+    snprintf(cmd + len, sizeof(cmd) - len, " -o \"%s\"", output);
+    int res = failed ? 1 : system(cmd);
+    for (int u = 0; u < units; u++) unlink(obj[u]);
+    return res;
+}
+
+/* default step budget for the compile-time run, so -O stays quick on long programs */
+#define PE_BUDGET 1000000L
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bfc [options] file.bf\n"
+        "  -o FILE             output binary (default a.out)\n"
+        "  -O0 -O1 -O2 -O3     optimization level, -O is -O3\n"
+        "  -fno-PASS           turn off linearize, fold-offsets, propagate or forward-stack\n"
+        "  -fpass-stats        print each pass's time and op counts\n"
+        "  --pe-budget N       steps run at compile time under -O3 (default %ld, 0 turns it off)\n"
+        "  -i, --jit, --asm    interpret, JIT-run, or build through the assembly backend\n"
+        "  -E, -R              print the preprocessed program; read bfpp -R output\n"
+        "  --cell-bits 8|16|32, --tape-size N, --bufsize N, -j N\n"
+        "  --no-cache, --no-intrinsics, --stack-intrinsics, --stats, --profile, --report FILE\n"
+        "  -fprofile-generate[=FILE], -fprofile-use[=FILE]\n",
+        PE_BUDGET);
+}
+
+static void bad_arg(const char *opt, const char *s) {
+    fprintf(stderr, "bfc: bad %s value %s\n", opt, s);
+}
+
+/* numeric option value in [lo, hi], or a diagnostic naming the option */
+static int num_arg(const char *opt, const char *s, long lo, long hi, long *v) {
+    char *end;
+    errno = 0;
+    *v = strtol(s, &end, 0);
+    if (errno || end == s || *end || *v < lo || *v > hi) { bad_arg(opt, s); return 0; }
+    return 1;
 }
 
 int main(int argc, char **argv) {
-    int flag_O = 0, flag_E = 0;
-    char *input_file = NULL, *output_file = "a.out";
+    int level = 0, flag_pass_stats = 0, flag_E = 0, flag_R = 0, flag_intrinsics = 1, flag_stack = 0, flag_run = 0, flag_i = 0, flag_stats = 0, flag_asm = 0, flag_cache = 1;
+    long pe_budget = PE_BUDGET;
+    unsigned long tape = TAPE_CONST_VAL;
+    int bits = 8;
+    long jobs = 0, v;
+    char *input_file = NULL, *output_file = "a.out", *report = NULL, *generate = NULL, *use = NULL, no_pass[256] = "";
     
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-O") == 0) flag_O = 1;
+        if (strcmp(argv[i], "-O") == 0) level = 3;
+        else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3]) level = argv[i][2] - '0';
+        else if (strncmp(argv[i], "-fno-", 5) == 0) {
+            if (!pass_disable(argv[i] + 5)) { fprintf(stderr, "bfc: unknown pass %s\n", argv[i] + 5); return 1; }
+            size_t n = strlen(no_pass);
+            snprintf(no_pass + n, sizeof(no_pass) - n, "%s,", argv[i] + 5);
+        }
+        else if (strcmp(argv[i], "-fpass-stats") == 0) flag_pass_stats = 1;
         else if (strcmp(argv[i], "-E") == 0) flag_E = 1;
+        else if (strcmp(argv[i], "-R") == 0) flag_R = 1;
+        else if (strcmp(argv[i], "--run") == 0 || strcmp(argv[i], "--jit") == 0) flag_run = 1;
+        else if (strcmp(argv[i], "-i") == 0) flag_i = 1;
+        else if (strcmp(argv[i], "--asm") == 0) flag_asm = 1;
+        else if (strcmp(argv[i], "--stats") == 0) flag_stats = 1;
+        else if (strcmp(argv[i], "--no-cache") == 0) flag_cache = 0;
+        else if (strcmp(argv[i], "--no-intrinsics") == 0) flag_intrinsics = 0;
+        else if (strcmp(argv[i], "--stack-intrinsics") == 0) flag_stack = 1;
+        else if (strcmp(argv[i], "--profile") == 0) profiling = 1;
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) report = argv[++i];
+        else if (strcmp(argv[i], "-fprofile-generate") == 0 || strncmp(argv[i], "-fprofile-generate=", 19) == 0) {
+            profiling = 1;
+            generate = argv[i][18] ? argv[i] + 19 : "bfc.prof";
+        }
+        else if (strcmp(argv[i], "-fprofile-use") == 0 || strncmp(argv[i], "-fprofile-use=", 14) == 0) use = argv[i][13] ? argv[i] + 14 : "bfc.prof";
         else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_file = argv[++i];
+        else if (strcmp(argv[i], "--bufsize") == 0 && i + 1 < argc) {
+            if (!num_arg(argv[i], argv[i + 1], 1, INT_MAX, &v)) return 1;
+            rt_bufsize = v, i++;
+        }
+        else if (strcmp(argv[i], "--pe-budget") == 0 && i + 1 < argc) {
+            if (!num_arg(argv[i], argv[i + 1], 0, LONG_MAX, &pe_budget)) return 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--tape-size") == 0 && i + 1 < argc) {
+            if (!num_arg(argv[i], argv[i + 1], 1, TAPE_SIZE_MAX, &v)) return 1;
+            tape = v, i++;
+        }
+        else if (strcmp(argv[i], "--cell-bits") == 0 && i + 1 < argc) {
+            if (!num_arg(argv[i], argv[i + 1], 8, 32, &v)) return 1;
+            if (v != 8 && v != 16 && v != 32) { bad_arg(argv[i], argv[i + 1]); return 1; }
+            bits = v, i++;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            if (!num_arg(argv[i], argv[i + 1], 0, LONG_MAX, &jobs)) return 1;
+            i++;
+        }
         else input_file = argv[i];
     }
     
-    if (!input_file) return 1;
+    if (!input_file) { usage(); return 1; }
+    if (jobs == 0) jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    tape_size = tape;
+    cell_bits = bits;
+    cell_mask = bits == 32 ? 0xFFFFFFFF : (1u << bits) - 1;
     
-    char cmd[4096];
-    snprintf(cmd, sizeof(cmd), "bfpp \"%s\"", input_file);
-    if (flag_E) return system(cmd) == 0 ? 0 : 1;
-    
-    FILE *pp_in = popen(cmd, "r");
-    parse_to_ir(pp_in); 
-    pclose(pp_in);
-    
-    if (flag_O) optimize_ir();
+    if (flag_E) {
+        pp_run(input_file, write_chunk, stdout);
+        return 0;
+    }
+
+    Reader reader = {{P_CODE}, HASH_INIT};
+    if (flag_intrinsics) pp_annotate(intrinsic_names(flag_stack));
+    if (profiling || report) pp_locations();
+    if (flag_R) {
+        /* already preprocessed by `bfpp -R` */
+        FILE *f = fopen(input_file, "rb");
+        if (!f) { fprintf(stderr, "Error opening file: %s\n", input_file); return 1; }
+        char *data = NULL;
+        size_t len = 0, cap = 0, got;
+        do {
+            if (len == cap) data = realloc(data, cap = cap ? cap * 2 : 65536);
+            len += got = fread(data + len, 1, cap - len, f);
+        } while (got > 0);
+        fclose(f);
+        if (!parse_rle(data, len)) { fprintf(stderr, "bfc: %s is not bfpp -R output\n", input_file); return 1; }
+        reader.hash = hash_bytes(hash_bytes(reader.hash, "R", 1), data, len);
+        free(data);
+    } else pp_run(input_file, read_chunk, &reader);
 
-    int is_c_output = 0;
     size_t out_len = strlen(output_file);
-    if (out_len > 2 && strcmp(output_file + out_len - 2, ".c") == 0) {
-        is_c_output = 1;
+    const char *ext = out_len > 2 ? output_file + out_len - 2 : "";
+    int is_text = strcmp(ext, ".c") == 0 || strcmp(ext, ".s") == 0;
+    if ((profiling || use) && (flag_run || flag_i || flag_asm || strcmp(ext, ".s") == 0)) {
+        fprintf(stderr, "bfc: %s needs the C backend\n", profiling ? "profiling" : "-fprofile-use");
+        return 1;
     }
 
-    if (is_c_output) {
-        FILE *c_out = fopen(output_file, "w");
-        generate_c(c_out, flag_O);
-        fclose(c_out);
-    } else {
-        char tmp_c[] = "/tmp/bfc_temp_XXXXXX.c";
-        int fd = mkstemp(tmp_c);
-        FILE *c_out = fdopen(fd, "w");
-        generate_c(c_out, flag_O); 
-        fclose(c_out);
-        
-        snprintf(cmd, sizeof(cmd), "cc %s \"%s\" -o \"%s\"", flag_O ? "-O3" : "", tmp_c, output_file);
-        int res = system(cmd);
-        
-        unlink(tmp_c);
+    /*
+     * cc keeps its own profile in FILE.d next to ours. The instrumented
+     * binary writes both to where they were asked for at compile time,
+     * like cc does.
+     */
+    char prof_path[4096], cwd[4096], cc_profile[8192] = "";
+    if (generate) {
+        int n = generate[0] == '/' || !getcwd(cwd, sizeof(cwd))
+            ? snprintf(prof_path, sizeof(prof_path), "%s", generate)
+            : snprintf(prof_path, sizeof(prof_path), "%s/%s", cwd, generate);
+        if (n < 0 || n >= (int)sizeof(prof_path)) { fprintf(stderr, "bfc: profile path too long: %s\n", generate); return 1; }
+        prof_file = prof_path;
+        snprintf(cc_profile, sizeof(cc_profile), " -fprofile-generate=\"%s.d\"", prof_path);
+    } else if (use) {
+        int n = snprintf(prof_path, sizeof(prof_path), "%s.d", use);
+        if (n < 0 || n >= (int)sizeof(prof_path)) { fprintf(stderr, "bfc: profile path too long: %s\n", use); return 1; }
+        if (access(prof_path, F_OK) == 0)
+            snprintf(cc_profile, sizeof(cc_profile), " -fprofile-use=\"%s\" -Wno-coverage-mismatch -Wno-missing-profile", prof_path);
+    }
+
+    uint64_t key = 0;
+    if (flag_cache && !flag_run && !flag_i && !report && !generate && !use) {
+        char flags[512];
+        snprintf(flags, sizeof(flags), "O=%d no=%s prof=%d asm=%d bufsize=%d tape=%u cells=%d pe=%ld out=%s", level, no_pass, profiling, flag_asm, rt_bufsize, tape_size, cell_bits, pe_budget, is_text ? ext : "");
+        key = cache_key(reader.hash, flags, is_text ? NULL : flag_asm ? "as" : "cc");
+        if (cache_fetch(key, output_file)) {
+            free(ir);
+            return 0;
+        }
+    }
+
+    run_passes(level, flag_pass_stats);
+
+    if (report) {
+        int res = prof_report(report);
+        free(ir);
+        return res;
+    }
+
+    if (flag_run || flag_i) {
+        int res = flag_i ? interp_run(flag_stats) : jit_run(flag_stats);
         free(ir);
-        return res == 0 ? 0 : 1;
+        return res;
+    }
+
+    if (use) {
+        LoopTree t;
+        loop_tree(&t);
+        pgo = prof_load(use, &t);
+        loop_tree_free(&t);
+    }
+
+    /*
+     * run everything up to the first input at compile time, unless it is to
+     * be profiled or has to match the code cc profiled
+     */
+    Machine pe, *start = NULL;
+    if (level >= 3 && pe_budget > 0 && !profiling && !*cc_profile) {
+        interp_prefix(&pe, pe_budget);
+        start = &pe;
+    }
+
+    char cmd[4096];
+    int res = 0;
+    if (is_text) {
+        FILE *f_out = fopen(output_file, "w");
+        if (ext[1] == 's') generate_asm(f_out, rt_bufsize, start);
+        else generate_c(&f_out, 1, level >= 3, rt_bufsize, start);
+        fclose(f_out);
+    } else if (flag_asm) {
+        char tmp_s[] = "/tmp/bfc_temp_XXXXXX.s";
+        int fd = mkstemps(tmp_s, 2);
+        FILE *s_out = fdopen(fd, "w");
+        generate_asm(s_out, rt_bufsize, start);
+        fclose(s_out);
+
+        char tmp_o[sizeof(tmp_s)];
+        snprintf(tmp_o, sizeof(tmp_o), "%.*so", (int)sizeof(tmp_s) - 3, tmp_s);
+        snprintf(cmd, sizeof(cmd), "as \"%s\" -o \"%s\" && ld \"%s\" -o \"%s\"", tmp_s, tmp_o, tmp_o, output_file);
+        res = system(cmd);
+
+        unlink(tmp_s);
+        unlink(tmp_o);
+    } else {
+        /* one unit per job; small programs never need more than one */
+        char *text[JOBS_MAX], tmp_c[JOBS_MAX][sizeof(TMP_C)];
+        size_t text_len[JOBS_MAX];
+        FILE *c_out[JOBS_MAX];
+        if (jobs > JOBS_MAX) jobs = JOBS_MAX;
+        for (int u = 0; u < jobs; u++) c_out[u] = open_memstream(&text[u], &text_len[u]);
+        int units = generate_c(c_out, jobs, level >= 3, rt_bufsize, start);
+        for (int u = 0; u < jobs; u++) {
+            fclose(c_out[u]);
+            if (u < units) {
+                strcpy(tmp_c[u], TMP_C);
+                int fd = mkstemps(tmp_c[u], 2);
+                if (write(fd, text[u], text_len[u]) != (ssize_t)text_len[u]) res = 1;
+                close(fd);
+            }
+            free(text[u]);
+        }
+
+        char opt[8200] = "";
+        if (level) snprintf(opt, sizeof(opt), "-O%d", level);
+        strcat(opt, cc_profile);
+        if (res == 0 && units == 1 && !*cc_profile) {
+            snprintf(cmd, sizeof(cmd), "cc %s \"%s\" -o \"%s\"", opt, tmp_c[0], output_file);
+            res = system(cmd);
+        } else if (res == 0) {
+            res = compile_units(tmp_c, units, opt, *cc_profile != 0, output_file);
+        }
+
+        for (int u = 0; u < units; u++) unlink(tmp_c[u]);
     }
 
+    if (res == 0 && key) cache_store(key, output_file);
+    free(pgo);
     free(ir);
-    return 0;
+    return res == 0 ? 0 : 1;
 }
@@ -0,0 +1,156 @@
+#ifndef BFC_H
+#define BFC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define BFC_VERSION "0.2"
+#define TAPE_CONST_VAL 65536
+#define TAPE_SIZE_MAX (1 << 30)
+
+/* cells on the tape, and the capacity of each EXT stack (--tape-size) */
+extern uint32_t tape_size;
+
+/* bits per tape and vstack cell (--cell-bits 8, 16 or 32) and their mask */
+extern int cell_bits;
+extern uint32_t cell_mask;
+#define CELL_BYTES (cell_bits / 8)
+
+typedef enum {
+    OP_ADD, OP_MOVE, OP_OUT, OP_IN, OP_JZ, OP_JNZ,
+    OP_CLEAR, OP_SET, OP_MUL, OP_MUL2, OP_SCAN,
+    OP_IF, OP_ENDIF, OP_OUTS,
+    OP_EXT_PTR_MAX, OP_EXT_PTR_ZERO,
+    OP_EXT_PUSH_V, OP_EXT_POP_V,
+    OP_EXT_PUSH_P, OP_EXT_POP_P,
+    OP_EXT_CLR_END, OP_EXT_CLR_BEGIN,
+    OP_SAVE, OP_RESTORE
+} OpType;
+
+/*
+ * OP_EXT_PUSH_* with val2 set cannot overflow and OP_EXT_POP_* with val2
+ * set cannot underflow. OP_SAVE/OP_RESTORE copy tape[ptr + off] to and
+ * from temporary val, standing in for a push and its pop (forward_stack()).
+ */
+#define STACK_TEMPS 16
+
+typedef struct {
+    OpType type;
+    int val;
+    int val2;
+    int off;
+    int val3;
+    int src;        /* origin for --profile (profile.c), 0 when not known */
+} Instruction;
+
+extern Instruction *ir;
+extern int ir_cap;
+extern int ir_len;
+
+/* bytes written by OP_OUTS: str_pool[val .. val + val2) */
+extern uint8_t *str_pool;
+extern int str_pool_len;
+int pool_add(const uint8_t *s, int n);
+
+/*
+ * Program state after running a prefix at compile time, resumed at pc.
+ * tape and vstack hold CELL_BYTES-wide cells.
+ */
+#define PE_OUT_MAX (1 << 20)
+
+typedef struct {
+    void *tape;
+    void *vstack;
+    uint32_t *pstack;
+    uint32_t ptr, vsp, psp;
+    uint32_t temp[STACK_TEMPS];
+    int pc;
+    uint8_t *out;
+    int out_len;
+} Machine;
+
+/* opt.c */
+int cell_signed(uint32_t v);
+int pass_disable(const char *name);
+void run_passes(int level, int stats);
+
+/* loops.c */
+#define LOOP_IO 1       /* reads or writes bytes */
+#define LOOP_STACK 2    /* pushes or pops an EXT stack */
+#define LOOP_PTR 4      /* leaves the pointer somewhere that does not follow from delta */
+
+typedef struct {
+    int start, end;         /* the JZ or IF and its matching JNZ or ENDIF, -1 if unmatched */
+    int parent;             /* enclosing loop, -1 at the top level */
+    int child, next;        /* first inner loop and next sibling, -1 for none */
+    int effects;            /* LOOP_* of the body, inner loops included */
+    int delta;              /* pointer move of one pass through the body */
+    int *writes;            /* cells the body may write, relative to the pointer at its start */
+    int nwrites;            /* -1 when not known (LOOP_PTR, or too many to list) */
+} Loop;
+
+typedef struct {
+    Loop *loop;             /* in order of start */
+    int len;
+    int *at;                /* at[i]: loop opened or closed by ir[i], -1 for anything else */
+} LoopTree;
+
+void loop_tree(LoopTree *t);
+void loop_tree_free(LoopTree *t);
+int loop_end(const LoopTree *t, int i);
+
+/* bfc.c */
+extern int ir_floor;
+void emit(OpType type, int val, int val2);
+int parse_rle(const char *s, size_t n);
+int resume_first(int pc);
+uint32_t cell_get(const void *cells, uint32_t i);
+size_t tape_guard(void);
+void put_string(FILE *out, const uint8_t *s, int n);
+
+/* profile.c */
+extern int prof_origin;
+void prof_mark(const char *mark);
+int prof_within(int src, const char *macro);
+uint64_t ir_hash(void);
+void prof_put_runtime(FILE *out, int loops, const char *path);
+uint64_t *prof_load(const char *path, const LoopTree *t);
+uint64_t *prof_costs(const LoopTree *t, const uint64_t *count);
+uint64_t prof_trip(const uint64_t *count, int loop);
+int prof_report(const char *path);
+
+/* intrin.c */
+const char *const *intrinsic_names(int stack);
+void intrinsic_begin(const char *name);
+void intrinsic_end(void);
+
+/* asm.c */
+void generate_asm(FILE *out, int bufsize, const Machine *start);
+
+/* cache.c */
+#define HASH_INIT 0xCBF29CE484222325ULL
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len);
+uint64_t cache_key(uint64_t src_hash, const char *flags, const char *tool);
+int cache_fetch(uint64_t key, const char *output);
+void cache_store(uint64_t key, const char *output);
+
+/* rt.c */
+void *rt_tape_map(void);
+void rt_tape_unmap(void);
+uint32_t rt_scan(void *tape, uint32_t p, int s);
+extern int rt_bufsize;
+void rt_io_init(void);
+void rt_io_done(void);
+void rt_flush(void);
+void rt_out(int c);
+void rt_outs(const uint8_t *s, int n);
+int rt_in(void);
+
+/* jit.c */
+int jit_run(int stats);
+
+/* interp.c */
+int interp_run(int stats);
+void interp_prefix(Machine *m, long budget);
+
+#endif
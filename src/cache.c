@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "bfc.h"
+
+/*
+ * Compile cache. Outputs are stored under $XDG_CACHE_HOME/bfc (or
+ * ~/.cache/bfc) named by a hash of the preprocessed source, the flags, the
+ * bfc build and the toolchain that produced them. A hit only bumps the
+ * entry's mtime, which is what eviction orders by once the directory grows
+ * past its size limit ($BFC_CACHE_SIZE bytes, 256 MiB by default).
+ */
+
+/* FNV-1a, continued from h */
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+static int cache_dir(char *dir, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(dir, size, "%s/bfc", xdg);
+    else if (home && *home) snprintf(dir, size, "%s/.cache/bfc", home);
+    else return 0;
+    char parent[4096];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(strrchr(dir, '/') - dir), dir);
+    mkdir(parent, 0755);
+    return mkdir(dir, 0755) == 0 || access(dir, W_OK) == 0;
+}
+
+/* first line of `tool --version`, so upgrading the compiler misses the cache */
+static void tool_identity(const char *tool, char *id, size_t size) {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "%s --version 2>/dev/null", tool);
+    FILE *p = popen(cmd, "r");
+    id[0] = 0;
+    if (!p) return;
+    if (!fgets(id, size, p)) id[0] = 0;
+    pclose(p);
+}
+
+uint64_t cache_key(uint64_t src_hash, const char *flags, const char *tool) {
+    char id[512] = "";
+    if (tool) tool_identity(tool, id, sizeof(id));
+    const char *version = BFC_VERSION " " __DATE__ " " __TIME__;
+    uint64_t h = HASH_INIT;
+    h = hash_bytes(h, version, strlen(version) + 1);
+    h = hash_bytes(h, id, strlen(id) + 1);
+    h = hash_bytes(h, flags, strlen(flags) + 1);
+    return hash_bytes(h, &src_hash, sizeof(src_hash));
+}
+
+static int copy_file(const char *from, const char *to) {
+    struct stat st;
+    FILE *in = fopen(from, "rb");
+    if (!in) return 0;
+    fstat(fileno(in), &st);
+    unlink(to);
+    FILE *out = fopen(to, "wb");
+    if (!out) { fclose(in); return 0; }
+    char buf[65536];
+    size_t n;
+    int ok = 1;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) if (fwrite(buf, 1, n, out) != n) ok = 0;
+    fclose(in);
+    if (fclose(out) != 0) ok = 0;
+    chmod(to, st.st_mode & 0777);
+    return ok;
+}
+
+static void entry_path(char *path, size_t size, const char *dir, uint64_t key) {
+    snprintf(path, size, "%s/%016llx", dir, (unsigned long long)key);
+}
+
+int cache_fetch(uint64_t key, const char *output) {
+    char dir[4096], path[4200];
+    if (!cache_dir(dir, sizeof(dir))) return 0;
+    entry_path(path, sizeof(path), dir, key);
+    if (access(path, R_OK) != 0 || !copy_file(path, output)) return 0;
+    utime(path, NULL);
+    return 1;
+}
+
+typedef struct {
+    char name[32];
+    off_t size;
+    time_t mtime;
+} Entry;
+
+static int by_age(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static void evict(const char *dir) {
+    const char *env = getenv("BFC_CACHE_SIZE");
+    long long limit = env ? atoll(env) : 256LL << 20, total = 0;
+    DIR *d = opendir(dir);
+    if (!d) return;
+    Entry *entries = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char path[4200];
+        struct stat st;
+        if (strlen(de->d_name) != 16) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (n == cap) entries = realloc(entries, sizeof(Entry) * (cap = cap ? cap * 2 : 64));
+        snprintf(entries[n].name, sizeof(entries[n].name), "%s", de->d_name);
+        entries[n].size = st.st_size;
+        entries[n].mtime = st.st_mtime;
+        total += st.st_size;
+        n++;
+    }
+    closedir(d);
+    qsort(entries, n, sizeof(Entry), by_age);
+    for (int i = 0; i < n && total > limit; i++) {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+        if (unlink(path) == 0) total -= entries[i].size;
+    }
+    free(entries);
+}
+
+void cache_store(uint64_t key, const char *output) {
+    char dir[4096], path[4200], tmp[4300];
+    if (!cache_dir(dir, sizeof(dir))) return;
+    entry_path(path, sizeof(path), dir, key);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (copy_file(output, tmp) && rename(tmp, path) == 0) evict(dir);
+    else unlink(tmp);
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bfc.h"
+
+/*
+ * Direct-threaded interpreter. Every IR instruction becomes one Code cell
+ * holding the address of its handler, so dispatch is a single indirect
+ * jump. Jump targets are resolved before execution starts.
+ */
+
+typedef struct {
+    const void *op;
+    int32_t a;
+    int32_t b;
+    int32_t off;
+    int32_t c;
+} Code;
+
+#define CELL uint8_t
+#define EXEC exec8
+#include "interp.h"
+#undef CELL
+#undef EXEC
+
+#define CELL uint16_t
+#define EXEC exec16
+#include "interp.h"
+#undef CELL
+#undef EXEC
+
+#define CELL uint32_t
+#define EXEC exec32
+#include "interp.h"
+#undef CELL
+#undef EXEC
+
+static uint64_t exec(Machine *m, long budget) {
+    if (cell_bits == 8) return exec8(m, budget);
+    if (cell_bits == 16) return exec16(m, budget);
+    return exec32(m, budget);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int interp_run(int stats) {
+    Machine m = {rt_tape_map(), calloc(tape_size, CELL_BYTES), calloc(tape_size, sizeof(uint32_t))};
+    double start = now();
+    rt_io_init();
+    uint64_t executed = exec(&m, 0);
+    rt_io_done();
+    if (stats) {
+        double elapsed = now() - start;
+        fprintf(stderr, "bfc: %llu ops in %.3f s (%.1f Mops/s)\n",
+                (unsigned long long)executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+    }
+    rt_tape_unmap();
+    free(m.vstack); free(m.pstack);
+    return 0;
+}
+
+/*
+ * Evaluate the program at compile time until the first input, or until
+ * the pointer or an access would leave the tape. m->tape lives until exit.
+ */
+void interp_prefix(Machine *m, long budget) {
+    *m = (Machine){calloc(tape_size, CELL_BYTES), calloc(tape_size, CELL_BYTES), calloc(tape_size, sizeof(uint32_t))};
+    m->out = malloc(PE_OUT_MAX);
+    exec(m, budget);
+}
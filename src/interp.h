@@ -0,0 +1,139 @@
+/*
+ * Runs m from m->pc. With a budget the run is a compile-time prefix
+ * evaluation: output is captured in m->out, and the run stops before the
+ * first input, before the pointer or an access leaves the tape, or once the
+ * budget is spent, leaving m->pc at the next instruction to execute.
+ *
+ * interp.c includes this once per cell width, with CELL set to the cell
+ * type and EXEC to the function name.
+ */
+static uint64_t EXEC(Machine *m, long budget) {
+    static const void *labels[] = {
+        [OP_ADD] = &&l_add, [OP_MOVE] = &&l_move, [OP_OUT] = &&l_out, [OP_IN] = &&l_in,
+        [OP_JZ] = &&l_jz, [OP_JNZ] = &&l_jnz, [OP_CLEAR] = &&l_clear, [OP_SET] = &&l_set,
+        [OP_MUL] = &&l_mul, [OP_MUL2] = &&l_mul2,
+        [OP_SCAN] = &&l_scan, [OP_IF] = &&l_if, [OP_ENDIF] = &&l_nop, [OP_OUTS] = &&l_outs,
+        [OP_EXT_PTR_MAX] = &&l_ptr_max, [OP_EXT_PTR_ZERO] = &&l_ptr_zero,
+        [OP_EXT_PUSH_V] = &&l_push_v, [OP_EXT_POP_V] = &&l_pop_v,
+        [OP_EXT_PUSH_P] = &&l_push_p, [OP_EXT_POP_P] = &&l_pop_p,
+        [OP_EXT_CLR_END] = &&l_clr_end, [OP_EXT_CLR_BEGIN] = &&l_clr_begin,
+        [OP_SAVE] = &&l_save, [OP_RESTORE] = &&l_restore
+    };
+    /* stack ops whose bounds check forward_stack() proved redundant */
+    static const void *unchecked_labels[] = {
+        [OP_EXT_PUSH_V] = &&u_push_v, [OP_EXT_POP_V] = &&u_pop_v,
+        [OP_EXT_PUSH_P] = &&u_push_p, [OP_EXT_POP_P] = &&u_pop_p
+    };
+    static const void *prefix_labels[] = {
+        [OP_MOVE] = &&p_move, [OP_OUT] = &&p_out, [OP_IN] = &&p_stop,
+        [OP_JNZ] = &&p_jnz, [OP_OUTS] = &&p_outs, [OP_SCAN] = &&p_scan
+    };
+
+    Code *code = malloc(sizeof(Code) * (ir_len + 1));
+    int *loops = malloc(sizeof(int) * (ir_len + 1));
+    /* with a budget: the lowest and highest offset each access reaches */
+    int32_t (*span)[2] = budget ? malloc(sizeof(*span) * (ir_len + 1)) : NULL;
+    int depth = 0;
+    for (int i = 0; i < ir_len; i++) {
+        OpType t = ir[i].type;
+        code[i] = (Code){labels[t], ir[i].val, ir[i].val2, ir[i].off, ir[i].val3};
+        if (t >= OP_EXT_PUSH_V && t <= OP_EXT_POP_P && ir[i].val2) code[i].op = unchecked_labels[t];
+        if (budget && t < (int)(sizeof(prefix_labels) / sizeof(prefix_labels[0])) && prefix_labels[t]) code[i].op = prefix_labels[t];
+        if (budget && (t == OP_ADD || t == OP_CLEAR || t == OP_SET || t == OP_IF || t == OP_MUL || t == OP_MUL2 || t == OP_SAVE || t == OP_RESTORE)) {
+            int lo = ir[i].off, hi = ir[i].off, to = ir[i].off + ir[i].val, by = ir[i].off + ir[i].val3;
+            if (t == OP_MUL || t == OP_MUL2) { lo = to < lo ? to : lo; hi = to > hi ? to : hi; }
+            if (t == OP_MUL2) { lo = by < lo ? by : lo; hi = by > hi ? by : hi; }
+            span[i][0] = lo;
+            span[i][1] = hi;
+            code[i].op = &&p_access;
+        }
+        if (t == OP_JZ || t == OP_IF) loops[depth++] = i;
+        else if (t == OP_JNZ || t == OP_ENDIF) {
+            if (depth == 0) { code[i].op = &&l_nop; continue; }
+            int open = loops[--depth];
+            code[open].a = i + 1;
+            code[i].a = open + 1;
+        }
+    }
+    while (depth > 0) code[loops[--depth]].a = ir_len;
+    code[ir_len] = (Code){&&l_end, 0, 0, 0, 0};
+    free(loops);
+
+    CELL *tape = m->tape, *vstack = m->vstack;
+    uint32_t *temp = m->temp;
+    uint32_t *pstack = m->pstack;
+    intptr_t ptr = m->ptr;
+    uint32_t vsp = m->vsp, psp = m->psp;
+    uint64_t executed = 0;
+    Code *ip = code + m->pc;
+
+#define NEXT do { executed++; goto *(++ip)->op; } while (0)
+#define JUMP(to) do { executed++; ip = code + (to); goto *ip->op; } while (0)
+
+    goto *ip->op;
+l_add: tape[ptr + ip->off] += ip->a; NEXT;
+l_move: ptr += ip->a; NEXT;
+l_out: rt_out(tape[ptr + ip->off]); NEXT;
+l_outs: rt_outs(str_pool + ip->a, ip->b); NEXT;
+l_in: tape[ptr + ip->off] = rt_in(); NEXT;
+l_jz: if (!tape[ptr]) JUMP(ip->a); NEXT;
+l_jnz: if (tape[ptr]) JUMP(ip->a); NEXT;
+l_if: if (!tape[ptr + ip->off]) JUMP(ip->a); NEXT;
+l_clear: tape[ptr + ip->off] = 0; NEXT;
+l_set: tape[ptr + ip->off] = ip->a; NEXT;
+l_mul: tape[ptr + ip->off + ip->a] += (uint32_t)tape[ptr + ip->off] * ip->b; NEXT;
+l_mul2: tape[ptr + ip->off + ip->a] += (uint32_t)tape[ptr + ip->off] * tape[ptr + ip->off + ip->c] * ip->b; NEXT;
+l_scan: ptr = rt_scan(tape, ptr, ip->a); NEXT;
+l_ptr_max: ptr = tape_size - 1; NEXT;
+l_ptr_zero: ptr = 0; NEXT;
+l_push_v: if (vsp < tape_size) vstack[vsp++] = tape[ptr]; NEXT;
+l_pop_v: if (vsp > 0) tape[ptr] = vstack[--vsp]; NEXT;
+l_push_p: if (psp < tape_size) pstack[psp++] = ptr; NEXT;
+l_pop_p: if (psp > 0) ptr = pstack[--psp]; NEXT;
+l_clr_end: if (ptr == tape_size - 1) tape[ptr] = 0; NEXT;
+l_clr_begin: if (ptr == 0) tape[ptr] = 0; NEXT;
+l_save: temp[ip->a] = tape[ptr + ip->off]; NEXT;
+l_restore: tape[ptr + ip->off] = temp[ip->a]; NEXT;
+l_nop: NEXT;
+
+u_push_v: vstack[vsp++] = tape[ptr]; NEXT;
+u_pop_v: tape[ptr] = vstack[--vsp]; NEXT;
+u_push_p: pstack[psp++] = ptr; NEXT;
+u_pop_p: ptr = pstack[--psp]; NEXT;
+
+p_move: if ((uintptr_t)(ptr + ip->a) >= tape_size) goto p_stop; ptr += ip->a; NEXT;
+p_access: {
+    /* an access off the tape is left for the program to report */
+    const int32_t *s = span[ip - code];
+    if ((uintptr_t)(ptr + s[0]) >= tape_size || (uintptr_t)(ptr + s[1]) >= tape_size) goto p_stop;
+    goto *labels[ir[ip - code].type];
+}
+p_out:
+    if (m->out_len == PE_OUT_MAX || (uintptr_t)(ptr + ip->off) >= tape_size) goto p_stop;
+    m->out[m->out_len++] = tape[ptr + ip->off];
+    NEXT;
+p_outs:
+    if (m->out_len + ip->b > PE_OUT_MAX) goto p_stop;
+    memcpy(m->out + m->out_len, str_pool + ip->a, ip->b);
+    m->out_len += ip->b;
+    NEXT;
+p_jnz: if ((long)executed >= budget) goto p_stop; goto l_jnz;
+p_scan: {
+    /* a scan that finds no zero on the tape is left for the program to report */
+    intptr_t p = ptr;
+    while ((uintptr_t)p < tape_size && tape[p]) p += ip->a;
+    if ((uintptr_t)p >= tape_size) goto p_stop;
+    ptr = p;
+    NEXT;
+}
+p_stop: ;
+l_end:
+#undef NEXT
+#undef JUMP
+
+    m->pc = ip - code;
+    m->ptr = ptr; m->vsp = vsp; m->psp = psp;
+    free(span);
+    free(code);
+    return executed;
+}
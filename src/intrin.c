@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bfc.h"
+
+/*
+ * Macro intrinsics. bfpp brackets every expansion of the macros below
+ * with origin marks; when the code inside a region is exactly the
+ * library's definition (given as `bfpp -R` tokens) it is replaced by the
+ * native ops. A redefined macro no longer matches and is left alone, and
+ * only the outermost region counts, so TONULL inside PUSH stays part of
+ * PUSH.
+ *
+ * PUSH and POP are only lowered on request (--stack-intrinsics): the
+ * portable stack lives on the tape 1000 cells right of the pointer, so a
+ * POP at another cell than its PUSH, or code that reaches those cells
+ * directly, sees something else than with the one native value stack.
+ */
+
+typedef struct {
+    const char *name;
+    const char *pattern;
+    Instruction ops[2];
+    int op_count;
+    int stack;              /* changes behaviour, only with --stack-intrinsics */
+    Instruction *ir;        /* pattern parsed on first use */
+    int ir_len;
+} Intrinsic;
+
+static Intrinsic intrinsics[] = {
+    {"TONULL", "[-]", {{.type = OP_CLEAR}}, 1, 0, NULL, 0},
+    {"MOVNXT", "[->+<]", {{.type = OP_MUL, .val = 1, .val2 = 1}, {.type = OP_CLEAR}}, 2, 0, NULL, 0},
+    {"MOVPR", "[-<+>]", {{.type = OP_MUL, .val = -1, .val2 = 1}, {.type = OP_CLEAR}}, 2, 0, NULL, 0},
+    /* inc/stack/stack.bfh: the value moves onto the stack, leaving the cell zero */
+    {"PUSH", ">999[-]<999[>999+<999-]>1000[>2]+<2[>[->2+<2]<3]>[->2+<2]<999",
+        {{.type = OP_EXT_PUSH_V}, {.type = OP_CLEAR}}, 2, 1, NULL, 0},
+    {"POP", "[-]>1001[<1001+>1001-]>[>[-<2+>2]>]<2[-]<2[<2]<998",
+        {{.type = OP_CLEAR}, {.type = OP_EXT_POP_V}}, 2, 1, NULL, 0},
+};
+
+#define INTRINSIC_COUNT (int)(sizeof(intrinsics) / sizeof(intrinsics[0]))
+
+static Intrinsic *region;
+static int depth, region_start, saved_floor;
+
+const char *const *intrinsic_names(int stack) {
+    static const char *names[INTRINSIC_COUNT + 1];
+    int n = 0;
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+        if (stack || !intrinsics[i].stack) names[n++] = intrinsics[i].name;
+    return names;
+}
+
+void intrinsic_begin(const char *name) {
+    if (depth++ > 0) return;
+    region = NULL;
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+        if (strcmp(intrinsics[i].name, name) == 0) region = &intrinsics[i];
+    region_start = ir_len;
+    saved_floor = ir_floor;
+    ir_floor = ir_len;
+}
+
+/* parse the pattern past the end of ir and keep a copy */
+static void load_pattern(Intrinsic *in) {
+    int base = ir_len, floor = ir_floor;
+    ir_floor = ir_len;
+    parse_rle(in->pattern, strlen(in->pattern));
+    in->ir_len = ir_len - base;
+    in->ir = malloc(sizeof(Instruction) * (in->ir_len + 1));
+    memcpy(in->ir, ir + base, sizeof(Instruction) * in->ir_len);
+    ir_len = base;
+    ir_floor = floor;
+}
+
+void intrinsic_end(void) {
+    if (depth == 0 || --depth > 0) return;
+    ir_floor = saved_floor;
+    if (!region) return;
+    if (!region->ir) load_pattern(region);
+    int len = ir_len - region_start;
+    if (len != region->ir_len) return;
+    for (int i = 0; i < len; i++) {
+        const Instruction *a = &ir[region_start + i], *b = &region->ir[i];
+        if (a->type != b->type || a->val != b->val) return;
+    }
+    int src = prof_within(ir[region_start].src, region->name);
+    ir_len = region_start;
+    for (int i = 0; i < region->op_count; i++) {
+        emit(region->ops[i].type, region->ops[i].val, region->ops[i].val2);
+        ir[ir_len - 1].src = src;
+    }
+    ir_floor = ir_len;
+}
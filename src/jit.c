@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "bfc.h"
+
+/*
+ * x86-64 JIT. Register layout inside the generated function:
+ *   rbx = tape, r12 = ptr, r13 = vstack, r15d = vsp, r14 = pstack, ebp = psp
+ * All of them are callee-saved, so the rt.c helpers can be called directly.
+ * Moves are 64-bit so a pointer run off the left end faults in the tape's
+ * guard instead of wrapping; the OP_SAVE temporaries live at [rsp], four
+ * bytes each whatever the cell width.
+ */
+
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+typedef void (*JitFn)(void *tape, void *vstack, uint32_t *pstack);
+
+static uint8_t *code = NULL;
+static size_t code_len = 0, code_cap = 0;
+
+static void b(uint8_t x) {
+    if (code_len >= code_cap) {
+        code_cap = code_cap == 0 ? 4096 : code_cap * 2;
+        code = realloc(code, code_cap);
+    }
+    code[code_len++] = x;
+}
+
+static void b32(int32_t x) {
+    for (int i = 0; i < 4; i++) b((uint32_t)x >> (i * 8));
+}
+
+static void b64(uint64_t x) {
+    for (int i = 0; i < 8; i++) b(x >> (i * 8));
+}
+
+static void patch32(size_t at, int32_t x) {
+    for (int i = 0; i < 4; i++) code[at + i] = (uint32_t)x >> (i * 8);
+}
+
+/* op reg, [base + index*scale + disp] */
+static void mem(int w, const char *opc, int olen, int reg, int base, int index, int scale, int disp) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40) b(rex);
+    for (int i = 0; i < olen; i++) b(opc[i]);
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP) mod = 0;
+    else if (disp >= -128 && disp <= 127) mod = 1;
+    b((mod << 6) | ((reg & 7) << 3) | 4);
+    b((scale << 6) | ((index & 7) << 3) | (base & 7));
+    if (mod == 1) b(disp);
+    else if (mod == 2) b32(disp);
+}
+
+/*
+ * Cell accesses for 8-, 16- and 32-bit cells. Loads zero-extend into the
+ * 32-bit register; the rest take a 0x66 prefix for 16-bit cells. C_ADDI
+ * and C_MOVI are followed by a cell-sized immediate, C_CMPI by a byte.
+ */
+enum { C_LOAD, C_STORE, C_ADD, C_SUB, C_ADDI, C_MOVI, C_CMPI };
+
+static const char *const cell_opcodes[][3] = {
+    [C_LOAD] = {"\x0F\xB6", "\x0F\xB7", "\x8B"},
+    [C_STORE] = {"\x88", "\x89", "\x89"},
+    [C_ADD] = {"\x00", "\x01", "\x01"},
+    [C_SUB] = {"\x28", "\x29", "\x29"},
+    [C_ADDI] = {"\x80", "\x81", "\x81"},
+    [C_MOVI] = {"\xC6", "\xC7", "\xC7"},
+    [C_CMPI] = {"\x80", "\x83", "\x83"},
+};
+
+/* op reg, cell [base + index + off] with index and off counted in cells */
+static void cell_mem(int op, int reg, int base, int index, int off) {
+    int w = cell_bits == 8 ? 0 : cell_bits == 16 ? 1 : 2;
+    if (w == 1 && op != C_LOAD) b(0x66);
+    mem(0, cell_opcodes[op][w], op == C_LOAD && w < 2 ? 2 : 1, reg, base, index, w, off * CELL_BYTES);
+}
+
+static void cell_imm(int32_t x) {
+    for (int i = 0; i < CELL_BYTES; i++) b((uint32_t)x >> (i * 8));
+}
+
+#define CELL(op, reg, off) cell_mem(op, reg, RBX, R12, off)
+
+static void call_abs(void *fn) {
+    b(0x48); b(0xB8); b64((uint64_t)(uintptr_t)fn); /* mov rax, imm64 */
+    b(0xFF); b(0xD0);                               /* call rax */
+}
+
+static size_t jcc8(uint8_t op) {
+    b(op); b(0);
+    return code_len;
+}
+
+static void land8(size_t from) {
+    code[from - 1] = code_len - from;
+}
+
+static void compile(void) {
+    size_t *loops = malloc(sizeof(size_t) * (ir_len + 1));
+    int depth = 0;
+
+    b(0x53); b(0x55);                     /* push rbx, rbp */
+    b(0x41); b(0x54); b(0x41); b(0x55);   /* push r12, r13 */
+    b(0x41); b(0x56); b(0x41); b(0x57);   /* push r14, r15 */
+    b(0x48); b(0x83); b(0xEC); b(0x48);   /* sub rsp, 72 */
+    b(0x48); b(0x89); b(0xFB);            /* mov rbx, rdi */
+    b(0x49); b(0x89); b(0xF5);            /* mov r13, rsi */
+    b(0x49); b(0x89); b(0xD6);            /* mov r14, rdx */
+    b(0x45); b(0x31); b(0xE4);            /* xor r12d, r12d */
+    b(0x45); b(0x31); b(0xFF);            /* xor r15d, r15d */
+    b(0x31); b(0xED);                     /* xor ebp, ebp */
+
+    for (int i = 0; i < ir_len; i++) {
+        Instruction inst = ir[i];
+        size_t skip;
+        switch (inst.type) {
+            case OP_ADD:
+                CELL(C_ADDI, 0, inst.off); cell_imm(inst.val);
+                break;
+            case OP_MOVE:
+                b(0x49); b(0x81); b(0xC4); b32(inst.val);
+                break;
+            case OP_OUT:
+                CELL(C_LOAD, RDI, inst.off);
+                call_abs(rt_out);
+                break;
+            case OP_OUTS:
+                b(0x48); b(0xBF); b64((uint64_t)(uintptr_t)(str_pool + inst.val)); /* mov rdi, imm64 */
+                b(0xBE); b32(inst.val2);                  /* mov esi, len */
+                call_abs(rt_outs);
+                break;
+            case OP_IN:
+                call_abs(rt_in);
+                CELL(C_STORE, RAX, inst.off);
+                break;
+            case OP_JZ:
+                CELL(C_CMPI, 7, 0); b(0);
+                b(0x0F); b(0x84); b32(0);
+                loops[depth++] = code_len;
+                break;
+            case OP_JNZ:
+                if (depth == 0) break;
+                CELL(C_CMPI, 7, 0); b(0);
+                b(0x0F); b(0x85); b32(0);
+                depth--;
+                patch32(code_len - 4, loops[depth] - code_len);
+                patch32(loops[depth] - 4, code_len - loops[depth]);
+                break;
+            case OP_IF:
+                CELL(C_CMPI, 7, inst.off); b(0);
+                b(0x0F); b(0x84); b32(0);
+                loops[depth++] = code_len;
+                break;
+            case OP_ENDIF:
+                if (depth == 0) break;
+                depth--;
+                patch32(loops[depth] - 4, code_len - loops[depth]);
+                break;
+            case OP_CLEAR:
+                CELL(C_MOVI, 0, inst.off); cell_imm(0);
+                break;
+            case OP_SET:
+                CELL(C_MOVI, 0, inst.off); cell_imm(inst.val);
+                break;
+            case OP_MUL:
+                CELL(C_LOAD, RAX, inst.off);
+                if (abs(inst.val2) != 1) { b(0x69); b(0xC0); b32(abs(inst.val2)); }
+                CELL(inst.val2 > 0 ? C_ADD : C_SUB, RAX, inst.off + inst.val);
+                break;
+            case OP_MUL2:
+                CELL(C_LOAD, RAX, inst.off);
+                CELL(C_LOAD, RCX, inst.off + inst.val3);
+                b(0x0F); b(0xAF); b(0xC1);                /* imul eax, ecx */
+                if (abs(inst.val2) != 1) { b(0x69); b(0xC0); b32(abs(inst.val2)); }
+                CELL(inst.val2 > 0 ? C_ADD : C_SUB, RAX, inst.off + inst.val);
+                break;
+            case OP_SCAN:
+                b(0x48); b(0x89); b(0xDF);                /* mov rdi, rbx */
+                b(0x44); b(0x89); b(0xE6);                /* mov esi, r12d */
+                b(0xBA); b32(inst.val);                   /* mov edx, stride */
+                call_abs(rt_scan);
+                b(0x41); b(0x89); b(0xC4);                /* mov r12d, eax */
+                break;
+            case OP_EXT_PTR_MAX:
+                b(0x41); b(0xBC); b32(tape_size - 1);
+                break;
+            case OP_EXT_PTR_ZERO:
+                b(0x45); b(0x31); b(0xE4);
+                break;
+            case OP_EXT_PUSH_V:
+                if (!inst.val2) { b(0x41); b(0x81); b(0xFF); b32(tape_size); }
+                skip = inst.val2 ? 0 : jcc8(0x73);
+                CELL(C_LOAD, RAX, 0);
+                cell_mem(C_STORE, RAX, R13, R15, 0);
+                b(0x41); b(0xFF); b(0xC7);
+                if (skip) land8(skip);
+                break;
+            case OP_EXT_POP_V:
+                if (!inst.val2) { b(0x45); b(0x85); b(0xFF); }
+                skip = inst.val2 ? 0 : jcc8(0x74);
+                b(0x41); b(0xFF); b(0xCF);
+                cell_mem(C_LOAD, RAX, R13, R15, 0);
+                CELL(C_STORE, RAX, 0);
+                if (skip) land8(skip);
+                break;
+            case OP_EXT_PUSH_P:
+                if (!inst.val2) { b(0x81); b(0xFD); b32(tape_size); }
+                skip = inst.val2 ? 0 : jcc8(0x73);
+                mem(0, "\x89", 1, R12, R14, RBP, 2, 0);
+                b(0xFF); b(0xC5);
+                if (skip) land8(skip);
+                break;
+            case OP_EXT_POP_P:
+                if (!inst.val2) { b(0x85); b(0xED); }
+                skip = inst.val2 ? 0 : jcc8(0x74);
+                b(0xFF); b(0xCD);
+                mem(0, "\x8B", 1, R12, R14, RBP, 2, 0);
+                if (skip) land8(skip);
+                break;
+            case OP_SAVE:
+                CELL(C_LOAD, RAX, inst.off);
+                mem(0, "\x89", 1, RAX, RSP, RSP, 0, inst.val * 4);
+                break;
+            case OP_RESTORE:
+                mem(0, "\x8B", 1, RAX, RSP, RSP, 0, inst.val * 4);
+                CELL(C_STORE, RAX, inst.off);
+                break;
+            case OP_EXT_CLR_END:
+                b(0x41); b(0x81); b(0xFC); b32(tape_size - 1);
+                skip = jcc8(0x75);
+                CELL(C_MOVI, 0, 0); cell_imm(0);
+                land8(skip);
+                break;
+            case OP_EXT_CLR_BEGIN:
+                b(0x45); b(0x85); b(0xE4);
+                skip = jcc8(0x75);
+                CELL(C_MOVI, 0, 0); cell_imm(0);
+                land8(skip);
+                break;
+        }
+    }
+    /* unmatched '[' jumps past the end of the program */
+    while (depth > 0) {
+        depth--;
+        patch32(loops[depth] - 4, code_len - loops[depth]);
+    }
+
+    b(0x48); b(0x83); b(0xC4); b(0x48);   /* add rsp, 72 */
+    b(0x41); b(0x5F); b(0x41); b(0x5E);   /* pop r15, r14 */
+    b(0x41); b(0x5D); b(0x41); b(0x5C);   /* pop r13, r12 */
+    b(0x5D); b(0x5B);                     /* pop rbp, rbx */
+    b(0xC3);
+    free(loops);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int jit_run(int stats) {
+    double start = now();
+    compile();
+    void *exec = mmap(NULL, code_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (exec == MAP_FAILED) { perror("mmap"); return 1; }
+    memcpy(exec, code, code_len);
+    free(code);
+    if (mprotect(exec, code_len, PROT_READ | PROT_EXEC) != 0) { perror("mprotect"); return 1; }
+
+    void *tape = rt_tape_map();
+    void *vstack = calloc(tape_size, CELL_BYTES);
+    uint32_t *pstack = calloc(tape_size, sizeof(uint32_t));
+    double compiled = now();
+    rt_io_init();
+    ((JitFn)exec)(tape, vstack, pstack);
+    rt_io_done();
+    if (stats) {
+        fprintf(stderr, "bfc: jit %d ops -> %zu bytes in %.3f ms, ran in %.3f s\n",
+                ir_len, code_len, (compiled - start) * 1e3, now() - compiled);
+    }
+
+    munmap(exec, code_len);
+    rt_tape_unmap();
+    free(vstack); free(pstack);
+    return 0;
+}
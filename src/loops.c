@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include "bfc.h"
+
+/*
+ * Loop tree. One walk over the IR matches every JZ/IF with its JNZ/ENDIF
+ * and summarizes each body bottom-up: what kinds of side effects it has,
+ * how far it moves the pointer and which cells it may write. An inner
+ * loop contributes its summary to the enclosing one instead of being
+ * scanned again, so passes that ask about a loop on entry pay for the
+ * summary, not the body.
+ */
+
+/* longer write lists are dropped and the loop clobbers everything */
+#define WRITES_MAX 1024
+
+typedef struct {
+    int loop;
+    int pos;        /* pointer relative to the start of the body */
+    int cap;
+} Frame;
+
+static void add_write(Loop *l, Frame *f, int off) {
+    if (l->nwrites < 0) return;
+    if (l->nwrites == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 8;
+        l->writes = realloc(l->writes, sizeof(int) * f->cap);
+    }
+    l->writes[l->nwrites++] = off;
+}
+
+static void drop_writes(Loop *l) {
+    free(l->writes);
+    l->writes = NULL;
+    l->nwrites = -1;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* sort and deduplicate the write list once the body is complete */
+static void close_writes(Loop *l) {
+    if (l->nwrites <= 0) return;
+    qsort(l->writes, l->nwrites, sizeof(int), cmp_int);
+    int n = 1;
+    for (int i = 1; i < l->nwrites; i++) if (l->writes[i] != l->writes[n - 1]) l->writes[n++] = l->writes[i];
+    l->nwrites = n;
+    if (n > WRITES_MAX) drop_writes(l);
+}
+
+void loop_tree(LoopTree *t) {
+    int n = 0, depth = 0;
+    for (int i = 0; i < ir_len; i++) n += ir[i].type == OP_JZ || ir[i].type == OP_IF;
+    t->loop = malloc(sizeof(Loop) * (n + 1));
+    t->at = malloc(sizeof(int) * (ir_len + 1));
+    t->len = 0;
+    Frame *open = malloc(sizeof(Frame) * (n + 1));
+    int *prev = malloc(sizeof(int) * (n + 2));    /* last child seen at each depth */
+    prev[0] = -1;
+
+    for (int i = 0; i < ir_len; i++) {
+        Instruction inst = ir[i];
+        Frame *f = depth > 0 ? &open[depth - 1] : NULL;
+        Loop *l = f ? &t->loop[f->loop] : NULL;
+        t->at[i] = -1;
+        switch (inst.type) {
+            case OP_JZ: case OP_IF: {
+                int id = t->len++;
+                t->loop[id] = (Loop){i, -1, f ? f->loop : -1, -1, -1, 0, 0, NULL, 0};
+                if (prev[depth] >= 0) t->loop[prev[depth]].next = id;
+                else if (l) l->child = id;
+                prev[depth] = id;
+                open[depth++] = (Frame){id, 0, 0};
+                prev[depth] = -1;
+                t->at[i] = id;
+                continue;
+            }
+            case OP_JNZ: case OP_ENDIF: {
+                if (!l) break;
+                Loop *in = l;
+                in->end = i;
+                in->delta = f->pos;
+                close_writes(in);
+                t->at[i] = f->loop;
+                depth--;
+                if (depth == 0) continue;
+                f = &open[depth - 1];
+                l = &t->loop[f->loop];
+                l->effects |= in->effects;
+                if (in->delta || (in->effects & LOOP_PTR)) {
+                    l->effects |= LOOP_PTR;
+                    drop_writes(l);
+                } else if (in->nwrites < 0) {
+                    drop_writes(l);
+                } else {
+                    for (int k = 0; k < in->nwrites; k++) add_write(l, f, f->pos + in->writes[k]);
+                }
+                continue;
+            }
+            default:
+                break;
+        }
+        if (!l) continue;
+        switch (inst.type) {
+            case OP_MOVE: f->pos += inst.val; break;
+            case OP_IN:
+                l->effects |= LOOP_IO;
+                add_write(l, f, f->pos + inst.off);
+                break;
+            case OP_OUT: case OP_OUTS: l->effects |= LOOP_IO; break;
+            case OP_ADD: case OP_CLEAR: case OP_SET: case OP_RESTORE: add_write(l, f, f->pos + inst.off); break;
+            case OP_MUL: case OP_MUL2: add_write(l, f, f->pos + inst.off + inst.val); break;
+            case OP_EXT_CLR_END: case OP_EXT_CLR_BEGIN: add_write(l, f, f->pos); break;
+            case OP_EXT_POP_V:
+                l->effects |= LOOP_STACK;
+                add_write(l, f, f->pos);
+                break;
+            case OP_EXT_PUSH_V: case OP_EXT_PUSH_P: l->effects |= LOOP_STACK; break;
+            case OP_EXT_POP_P:
+                l->effects |= LOOP_STACK;
+                /* fall through */
+            case OP_SCAN: case OP_EXT_PTR_MAX: case OP_EXT_PTR_ZERO:
+                l->effects |= LOOP_PTR;
+                drop_writes(l);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* unmatched openers are plain instructions to every pass */
+    while (depth > 0) {
+        Loop *l = &t->loop[open[--depth].loop];
+        t->at[l->start] = -1;
+        drop_writes(l);
+    }
+    free(open);
+    free(prev);
+}
+
+void loop_tree_free(LoopTree *t) {
+    for (int i = 0; i < t->len; i++) free(t->loop[i].writes);
+    free(t->loop);
+    free(t->at);
+}
+
+/* the JNZ/ENDIF matching the JZ/IF at i, -1 for anything else */
+int loop_end(const LoopTree *t, int i) {
+    int id = t->at[i];
+    return id >= 0 && t->loop[id].start == i ? t->loop[id].end : -1;
+}
@@ -0,0 +1,1006 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bfc.h"
+
+/*
+ * Loop linearization.
+ *
+ * A loop body without I/O, EXT ops or inner control flow is an affine map
+ * over the cells it touches: every cell ends up as c + sum(coef * cell).
+ * The analyzer evaluates the body symbolically over sparse maps of such
+ * expressions and tries to find a closed form for running it n times,
+ * where n follows from the counter cell's step (the counter must change by
+ * an odd constant, so n = -counter * inverse(step) mod 2^cell_bits).
+ *
+ * With d_k the change made by iteration k, the closed form exists when
+ * d_3 == d_2: from the second iteration on every cell changes by a fixed
+ * amount, which may depend only on cells that no longer change. If
+ * d_1 differs from d_2 (e.g. a temporary is only zero after the first
+ * inner copy loop) the first iteration is peeled off and kept as is.
+ * The result is wrapped in OP_IF on the counter, which later passes can see
+ * through when nesting closed forms into an outer loop.
+ */
+
+typedef struct {
+    int off;
+    uint32_t coef;
+} Term;
+
+typedef struct {
+    uint32_t c;
+    int n, cap;
+    Term *t;
+} Expr;
+
+typedef struct {
+    int off;
+    Expr e;
+} Slot;
+
+typedef struct {
+    int n, cap;
+    Slot *s;
+} State;
+
+/* all arithmetic on cell values is unsigned and reduced by cell_mask */
+int cell_signed(uint32_t v) {
+    v &= cell_mask;
+    return v > cell_mask / 2 ? (int)(v | ~cell_mask) : (int)v;
+}
+
+static uint32_t mod_inverse(uint32_t k) {
+    uint32_t inv = k;
+    for (int i = 0; i < 5; i++) inv *= 2 - k * inv;
+    return inv & cell_mask;
+}
+
+static void expr_free(Expr *e) {
+    free(e->t);
+    *e = (Expr){0};
+}
+
+static Expr expr_copy(const Expr *e) {
+    Expr r = {e->c, e->n, e->n, NULL};
+    if (e->n) {
+        r.t = malloc(sizeof(Term) * e->n);
+        memcpy(r.t, e->t, sizeof(Term) * e->n);
+    }
+    return r;
+}
+
+static Expr expr_var(int off) {
+    Expr r = {0, 1, 1, malloc(sizeof(Term))};
+    r.t[0] = (Term){off, 1};
+    return r;
+}
+
+/* dst += f * src, keeping terms sorted by offset and dropping zeros */
+static void expr_add(Expr *dst, const Expr *src, uint32_t f) {
+    dst->c = (dst->c + f * src->c) & cell_mask;
+    for (int i = 0; i < src->n; i++) {
+        int off = src->t[i].off, k = 0;
+        uint32_t coef = (f * src->t[i].coef) & cell_mask;
+        while (k < dst->n && dst->t[k].off < off) k++;
+        if (k < dst->n && dst->t[k].off == off) {
+            dst->t[k].coef = (dst->t[k].coef + coef) & cell_mask;
+            if (dst->t[k].coef == 0) {
+                memmove(dst->t + k, dst->t + k + 1, sizeof(Term) * (dst->n - k - 1));
+                dst->n--;
+            }
+        } else if (coef) {
+            if (dst->n == dst->cap) {
+                dst->cap = dst->cap ? dst->cap * 2 : 4;
+                dst->t = realloc(dst->t, sizeof(Term) * dst->cap);
+            }
+            memmove(dst->t + k + 1, dst->t + k, sizeof(Term) * (dst->n - k));
+            dst->t[k] = (Term){off, coef};
+            dst->n++;
+        }
+    }
+}
+
+static int expr_equal(const Expr *a, const Expr *b) {
+    if (a->c != b->c || a->n != b->n) return 0;
+    for (int i = 0; i < a->n; i++) {
+        if (a->t[i].off != b->t[i].off || a->t[i].coef != b->t[i].coef) return 0;
+    }
+    return 1;
+}
+
+static int expr_is_zero(const Expr *e) {
+    return e->c == 0 && e->n == 0;
+}
+
+static void state_free(State *st) {
+    for (int i = 0; i < st->n; i++) expr_free(&st->s[i].e);
+    free(st->s);
+    *st = (State){0};
+}
+
+static State state_copy(const State *st) {
+    State r = {st->n, st->n, malloc(sizeof(Slot) * (st->n + 1))};
+    for (int i = 0; i < st->n; i++) r.s[i] = (Slot){st->s[i].off, expr_copy(&st->s[i].e)};
+    return r;
+}
+
+static Slot *state_find(const State *st, int off) {
+    for (int i = 0; i < st->n; i++) if (st->s[i].off == off) return &st->s[i];
+    return NULL;
+}
+
+/* cells never written keep their initial value */
+static Expr *state_get(State *st, int off) {
+    Slot *slot = state_find(st, off);
+    if (slot) return &slot->e;
+    if (st->n == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 8;
+        st->s = realloc(st->s, sizeof(Slot) * st->cap);
+    }
+    st->s[st->n] = (Slot){off, expr_var(off)};
+    return &st->s[st->n++].e;
+}
+
+static void state_set(State *st, int off, Expr e) {
+    Expr *slot = state_get(st, off);
+    expr_free(slot);
+    *slot = e;
+}
+
+static Expr state_value(const State *st, int off) {
+    Slot *slot = state_find(st, off);
+    return slot ? expr_copy(&slot->e) : expr_var(off);
+}
+
+static int eval_body(State *st, const Instruction *body, int len, int pos);
+
+static int find_endif(const Instruction *body, int len, int i) {
+    for (int depth = 0; i < len; i++) {
+        if (body[i].type == OP_IF) depth++;
+        else if (body[i].type == OP_ENDIF && --depth == 0) return i;
+    }
+    return -1;
+}
+
+/*
+ * An if-block can be treated as straight-line code when running it with the
+ * tested cell at zero changes nothing, which holds for the closed forms
+ * emitted below: every product has the counter as a factor.
+ */
+static int if_is_transparent(const Instruction *body, int len, int tested) {
+    State local = {0};
+    int ok = eval_body(&local, body, len, 0);
+    for (int i = 0; i < local.n && ok; i++) {
+        Expr e = expr_copy(&local.s[i].e), id = expr_var(local.s[i].off), zero = expr_var(tested);
+        uint32_t coef = 0;
+        for (int k = 0; k < e.n; k++) if (e.t[k].off == tested) coef = e.t[k].coef;
+        if (coef) expr_add(&e, &zero, -coef);
+        if (local.s[i].off == tested) expr_free(&id);
+        ok = expr_equal(&e, &id);
+        expr_free(&e); expr_free(&id); expr_free(&zero);
+    }
+    state_free(&local);
+    return ok;
+}
+
+/* apply one run of the body to st; 0 if the body is not affine or not balanced */
+static int eval_body(State *st, const Instruction *body, int len, int pos) {
+    int start = pos;
+    for (int i = 0; i < len; i++) {
+        const Instruction *inst = &body[i];
+        int at = pos + inst->off;
+        switch (inst->type) {
+            case OP_MOVE:
+                pos += inst->val;
+                break;
+            case OP_ADD: {
+                Expr *e = state_get(st, at);
+                e->c = (e->c + inst->val) & cell_mask;
+                break;
+            }
+            case OP_CLEAR: {
+                Expr *e = state_get(st, at);
+                expr_free(e);
+                break;
+            }
+            case OP_MUL: {
+                Expr src = state_value(st, at);
+                expr_add(state_get(st, at + inst->val), &src, inst->val2);
+                expr_free(&src);
+                break;
+            }
+            case OP_IF: {
+                int end = find_endif(body, len, i);
+                if (end < 0 || !if_is_transparent(body + i + 1, end - i - 1, inst->off)) return 0;
+                if (!eval_body(st, body + i + 1, end - i - 1, pos)) return 0;
+                i = end;
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+    return pos == start;
+}
+
+static Instruction *lin = NULL;
+static int lin_len = 0, lin_cap = 0;
+
+static void lin_emit(Instruction inst) {
+    if (lin_len == lin_cap) {
+        lin_cap = lin_cap ? lin_cap * 2 : 64;
+        lin = realloc(lin, sizeof(Instruction) * lin_cap);
+    }
+    lin[lin_len++] = inst;
+}
+
+/* a cell stays fixed while the closed form runs if the body never writes it or its delta is zero */
+static int is_fixed(const State *delta, int off) {
+    Slot *slot = state_find(delta, off);
+    return off != 0 && (!slot || expr_is_zero(&slot->e));
+}
+
+/*
+ * Emit x += n * delta for one cell, with n = counter * t. Terms of delta must
+ * refer to fixed cells, so the products can be applied in any order.
+ */
+static int emit_delta(int x, const Expr *delta, uint32_t t, const State *steady) {
+    if (delta->c) lin_emit((Instruction){OP_MUL, x, cell_signed(delta->c * t), 0});
+    for (int i = 0; i < delta->n; i++) {
+        if (!is_fixed(steady, delta->t[i].off)) return 0;
+        lin_emit((Instruction){OP_MUL2, x, cell_signed(delta->t[i].coef * t), 0, delta->t[i].off});
+    }
+    return 1;
+}
+
+/*
+ * Try to replace the loop whose body (without brackets) is given. On
+ * success the replacement is left in lin[0..lin_len) and 1 is returned.
+ */
+static int linearize_loop(const Instruction *body, int len) {
+    State s1 = {0}, s2, s3, d1 = {0}, d2 = {0};
+    int ok = 0;
+    lin_len = 0;
+
+    if (!eval_body(&s1, body, len, 0)) goto done;
+    Expr step = state_value(&s1, 0), v0 = expr_var(0);
+    expr_add(&step, &v0, cell_mask);
+    uint32_t k = step.c;
+    int is_const = step.n == 0;
+    expr_free(&step);
+    expr_free(&v0);
+    if (!is_const || !(k & 1)) goto done;
+    uint32_t t = -mod_inverse(k) & cell_mask;
+
+    s2 = state_copy(&s1);
+    if (!eval_body(&s2, body, len, 0)) { state_free(&s2); goto done; }
+    s3 = state_copy(&s2);
+    if (!eval_body(&s3, body, len, 0)) { state_free(&s2); state_free(&s3); goto done; }
+
+    /* deltas of every touched cell for iterations 1, 2 and 3 */
+    int peel = 0;
+    ok = 1;
+    for (int i = 0; i < s3.n && ok; i++) {
+        int off = s3.s[i].off;
+        Expr v = expr_var(off), a = state_value(&s1, off), b = state_value(&s2, off);
+        Expr e1 = expr_copy(&a), e2 = expr_copy(&b), e3 = expr_copy(&s3.s[i].e);
+        expr_add(&e1, &v, cell_mask);
+        expr_add(&e2, &a, cell_mask);
+        expr_add(&e3, &b, cell_mask);
+        if (!expr_equal(&e2, &e3)) ok = 0;
+        if (!expr_equal(&e1, &e2)) peel = 1;
+        if (off != 0) {
+            state_set(&d1, off, e1);
+            state_set(&d2, off, e2);
+        } else {
+            expr_free(&e1);
+            expr_free(&e2);
+        }
+        expr_free(&e3); expr_free(&v); expr_free(&a); expr_free(&b);
+    }
+    state_free(&s2);
+    state_free(&s3);
+    if (!ok) goto done;
+
+    /* the guard keeps a zero-trip loop from touching cells it never reaches */
+    int guard = peel;
+    for (int i = 0; i < d2.n; i++) if (!is_fixed(&d2, d2.s[i].off)) guard = 1;
+    if (guard) lin_emit((Instruction){OP_IF, 0, 0});
+    if (peel) for (int i = 0; i < len; i++) lin_emit(body[i]);
+    for (int i = 0; i < d1.n && ok; i++) {
+        int off = d1.s[i].off;
+        if (is_fixed(&d2, off)) continue;
+        ok = emit_delta(off, &d1.s[i].e, t, &d2);
+    }
+    lin_emit((Instruction){OP_CLEAR, 0, 0});
+    if (guard) lin_emit((Instruction){OP_ENDIF, 0, 0});
+
+done:
+    state_free(&s1);
+    state_free(&d1);
+    state_free(&d2);
+    return ok;
+}
+
+/*
+ * Rewrites ir in place: output never passes the read position except when
+ * a closed form is longer than its loop, and then the unread tail is moved
+ * to the end of a buffer twice the size.
+ */
+static void make_room(int need, int *rd, int *rd_end) {
+    if (need <= *rd) return;
+    int tail = *rd_end - *rd, cap = ir_cap * 2;
+    while (cap < need + tail) cap *= 2;
+    ir = realloc(ir, sizeof(Instruction) * cap);
+    memmove(ir + cap - tail, ir + *rd, sizeof(Instruction) * tail);
+    *rd = cap - tail;
+    *rd_end = ir_cap = cap;
+}
+
+static void optimize_ir(void) {
+    int rd = 0, rd_end = ir_len, new_len = 0;
+    int *loops = malloc(sizeof(int) * (ir_len + 1));
+    int depth = 0;
+
+    while (rd < rd_end) {
+        Instruction inst = ir[rd++];
+        if (inst.type == OP_JZ) {
+            loops[depth++] = new_len;
+        } else if (inst.type == OP_JNZ && depth > 0) {
+            int start = loops[--depth];
+            Instruction *body = ir + start + 1;
+            int len = new_len - start - 1;
+            if (len == 1 && body[0].type == OP_MOVE) {
+                ir[start] = (Instruction){OP_SCAN, body[0].val, 0, 0, 0, ir[start].src};
+                new_len = start + 1;
+                continue;
+            }
+            if (linearize_loop(body, len)) {
+                int src = ir[start].src;
+                make_room(start + lin_len, &rd, &rd_end);
+                memcpy(ir + start, lin, sizeof(Instruction) * lin_len);
+                for (int k = 0; k < lin_len; k++) ir[start + k].src = src;
+                new_len = start + lin_len;
+                continue;
+            }
+        }
+        ir[new_len++] = inst;
+    }
+    free(loops);
+    ir_len = new_len;
+}
+
+static void fold_offsets(void) {
+    int new_len = 0, pending = 0;
+    for (int i = 0; i < ir_len; i++) {
+        Instruction inst = ir[i];
+        switch (inst.type) {
+            case OP_MOVE:
+                pending += inst.val;
+                continue;
+            case OP_ADD: case OP_OUT: case OP_IN: case OP_CLEAR: case OP_SET: case OP_MUL: case OP_MUL2:
+            case OP_IF: case OP_SAVE: case OP_RESTORE:
+                inst.off += pending;
+                break;
+            case OP_ENDIF: case OP_OUTS:
+                break;
+            default:
+                if (pending) ir[new_len++] = (Instruction){OP_MOVE, pending, 0};
+                pending = 0;
+        }
+        ir[new_len++] = inst;
+    }
+    if (pending) ir[new_len++] = (Instruction){OP_MOVE, pending, 0};
+    ir_len = new_len;
+}
+
+/*
+ * Known-value propagation over the offset-folded IR.
+ *
+ * Facts are kept relative to the pointer: a cell is either a known value or
+ * unknown, and while `zero` holds every cell without a fact is known to be 0
+ * (true at program start). Loops are entered with every cell the body may
+ * write forgotten, which is also the state after the loop; if-blocks join
+ * the facts of both paths. Adds to known cells become OP_SET, loops and
+ * if-blocks that cannot run are dropped, products of known cells fold and
+ * output of known cells is collected into OP_OUTS strings.
+ */
+
+/* values are 0 .. cell_mask, so a long has room for UNKNOWN at every width */
+#define UNKNOWN -1
+#define MAX_FACTS 1024
+
+typedef struct {
+    int off;
+    long val;
+} Fact;
+
+typedef struct {
+    int n, cap;
+    Fact *f;
+    int base;
+    int zero;
+    int ptr_known;
+    uint32_t ptr;
+} Known;
+
+static Fact *known_find(const Known *k, int off) {
+    for (int i = 0; i < k->n; i++) if (k->f[i].off == k->base + off) return &k->f[i];
+    return NULL;
+}
+
+static long known_get(const Known *k, int off) {
+    /* a cell off the tape has no value: the access stays, and faults */
+    if (k->ptr_known && k->ptr + off >= tape_size) return UNKNOWN;
+    Fact *f = known_find(k, off);
+    return f ? f->val : k->zero ? 0 : UNKNOWN;
+}
+
+static void known_forget(Known *k) {
+    k->n = 0;
+    k->zero = 0;
+}
+
+static void known_put(Known *k, int off, long val) {
+    Fact *f = known_find(k, off);
+    if (f) { f->val = val; return; }
+    if (val == UNKNOWN && !k->zero) return;
+    if (k->n == MAX_FACTS) { known_forget(k); if (val == UNKNOWN) return; }
+    if (k->n == k->cap) {
+        k->cap = k->cap ? k->cap * 2 : 16;
+        k->f = realloc(k->f, sizeof(Fact) * k->cap);
+    }
+    k->f[k->n++] = (Fact){k->base + off, val};
+}
+
+static Known known_copy(const Known *k) {
+    Known r = *k;
+    r.cap = k->n;
+    r.f = malloc(sizeof(Fact) * (k->n + 1));
+    if (k->n) memcpy(r.f, k->f, sizeof(Fact) * k->n);
+    return r;
+}
+
+/* facts that hold after either a or b; the result replaces a */
+static void known_join(Known *a, Known *b) {
+    Known r = {0, 0, NULL, a->base, a->zero && b->zero, a->ptr_known && b->ptr_known && a->ptr == b->ptr, a->ptr};
+    for (int i = 0; i < a->n; i++) {
+        int off = a->f[i].off - a->base;
+        long v = known_get(b, off);
+        known_put(&r, off, v == a->f[i].val ? v : UNKNOWN);
+    }
+    for (int i = 0; i < b->n; i++) {
+        int off = b->f[i].off - b->base;
+        long v = known_get(a, off);
+        if (!known_find(&r, off)) known_put(&r, off, v == b->f[i].val ? v : UNKNOWN);
+    }
+    free(a->f);
+    *a = r;
+}
+
+static void known_move(Known *k, int by) {
+    k->base += by;
+    k->ptr += by;
+}
+
+/*
+ * Forget every cell loop l may write. Returns 0 when the pointer is not
+ * restored on every path, in which case nothing relative to it survives.
+ */
+static int known_clobber(Known *k, const Loop *l) {
+    if ((l->effects & LOOP_PTR) || l->delta || l->nwrites < 0) return 0;
+    for (int i = 0; i < l->nwrites; i++) known_put(k, l->writes[i], UNKNOWN);
+    return 1;
+}
+
+typedef struct {
+    Known at;
+    int keep;
+} Block;
+
+/*
+ * Output does not depend on the tape, so it can move above plain tape
+ * writes: merge into an earlier OP_OUTS when only such writes separate them.
+ */
+static int merge_outs(Instruction *out, int w, Instruction outs) {
+    for (int j = w - 1; j >= 0 && j >= w - 64; j--) {
+        switch (out[j].type) {
+            case OP_OUTS:
+                if (out[j].val + out[j].val2 != outs.val) out[j].val = pool_add(str_pool + out[j].val, out[j].val2);
+                if (out[j].val + out[j].val2 != outs.val) pool_add(str_pool + outs.val, outs.val2);
+                out[j].val2 += outs.val2;
+                return 1;
+            case OP_ADD: case OP_SET: case OP_CLEAR: case OP_MUL: case OP_MUL2: case OP_MOVE:
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/* emit tape[off] += add, or a set when the old value is known */
+static void fold_add(Known *k, Instruction *out, int *w, int off, int add, int src) {
+    long v = known_get(k, off);
+    if (add == 0) return;
+    if (v == UNKNOWN) {
+        out[(*w)++] = (Instruction){OP_ADD, add, 0, off, 0, src};
+        return;
+    }
+    v = (v + add) & cell_mask;
+    out[(*w)++] = v ? (Instruction){OP_SET, v, 0, off, 0, src} : (Instruction){OP_CLEAR, 0, 0, off, 0, src};
+    known_put(k, off, v);
+}
+
+static int propagate(void) {
+    LoopTree t;
+    loop_tree(&t);
+    Block *blocks = malloc(sizeof(Block) * (ir_len + 1));
+    Known k = {0};
+    int w = 0, depth = 0, changed = 0;
+    k.zero = 1;
+    k.ptr_known = 1;
+
+    for (int i = 0; i < ir_len; i++) {
+        Instruction inst = ir[i];
+        int off = inst.off;
+        long v = known_get(&k, off);
+        switch (inst.type) {
+            case OP_ADD:
+                fold_add(&k, ir, &w, off, inst.val, inst.src);
+                changed += v != UNKNOWN;
+                if (v == UNKNOWN) known_put(&k, off, UNKNOWN);
+                continue;
+            case OP_CLEAR: case OP_SET:
+                if (v == ((uint32_t)inst.val & cell_mask)) { changed++; continue; }
+                known_put(&k, off, (uint32_t)inst.val & cell_mask);
+                break;
+            case OP_IN: case OP_RESTORE:
+                known_put(&k, off, UNKNOWN);
+                break;
+            case OP_OUT:
+                if (v == UNKNOWN) break;
+                uint8_t c = v;
+                inst = (Instruction){OP_OUTS, pool_add(&c, 1), 1, 0, 0, inst.src};
+                changed++;
+                /* fall through */
+            case OP_OUTS:
+                if (merge_outs(ir, w, inst)) { changed++; continue; }
+                break;
+            case OP_MUL:
+                if (v != UNKNOWN) {
+                    fold_add(&k, ir, &w, off + inst.val, cell_signed((uint32_t)v * inst.val2), inst.src);
+                    changed++;
+                    continue;
+                }
+                known_put(&k, off + inst.val, UNKNOWN);
+                break;
+            case OP_MUL2: {
+                long v2 = known_get(&k, off + inst.val3);
+                if (v != UNKNOWN && v2 != UNKNOWN) {
+                    fold_add(&k, ir, &w, off + inst.val, cell_signed((uint32_t)v * (uint32_t)v2 * inst.val2), inst.src);
+                    changed++;
+                    continue;
+                }
+                if (v == 0 || v2 == 0) { changed++; continue; }
+                if (v != UNKNOWN || v2 != UNKNOWN) {
+                    int src = v == UNKNOWN ? off : off + inst.val3, f = cell_signed((uint32_t)(v == UNKNOWN ? v2 : v) * inst.val2);
+                    changed++;
+                    if (f) {
+                        known_put(&k, off + inst.val, UNKNOWN);
+                        ir[w++] = (Instruction){OP_MUL, off + inst.val - src, f, src, 0, inst.src};
+                    }
+                    continue;
+                }
+                known_put(&k, off + inst.val, UNKNOWN);
+                break;
+            }
+            case OP_MOVE:
+                known_move(&k, inst.val);
+                break;
+            case OP_JZ:
+                v = known_get(&k, 0);
+                if (v == 0 && t.at[i] >= 0) { i = loop_end(&t, i); changed++; continue; }
+                if (t.at[i] < 0 || !known_clobber(&k, &t.loop[t.at[i]])) {
+                    known_forget(&k);
+                    k.ptr_known = 0;
+                }
+                blocks[depth++] = (Block){known_copy(&k), 1};
+                break;
+            case OP_JNZ:
+                if (t.at[i] < 0) break;
+                free(k.f);
+                k = blocks[--depth].at;
+                known_put(&k, 0, 0);
+                break;
+            case OP_IF:
+                if (t.at[i] < 0) break;
+                if (v == 0) { i = loop_end(&t, i); changed++; continue; }
+                blocks[depth++] = (Block){known_copy(&k), v == UNKNOWN};
+                if (v != UNKNOWN) { changed++; continue; }
+                break;
+            case OP_ENDIF:
+                if (t.at[i] < 0) break;
+                depth--;
+                if (blocks[depth].keep) known_join(&k, &blocks[depth].at);
+                free(blocks[depth].at.f);
+                if (!blocks[depth].keep) continue;
+                break;
+            case OP_SCAN:
+                if (known_get(&k, 0) == 0) { changed++; continue; }
+                known_forget(&k);
+                k.ptr_known = 0;
+                known_put(&k, 0, 0);
+                break;
+            case OP_EXT_PTR_MAX: case OP_EXT_PTR_ZERO: {
+                uint32_t to = inst.type == OP_EXT_PTR_MAX ? tape_size - 1 : 0;
+                if (k.ptr_known && k.ptr == to) { changed++; continue; }
+                if (k.ptr_known) known_move(&k, to - k.ptr);
+                else known_forget(&k);
+                k.ptr_known = 1;
+                k.ptr = to;
+                break;
+            }
+            case OP_EXT_POP_P:
+                known_forget(&k);
+                k.ptr_known = 0;
+                break;
+            case OP_EXT_POP_V:
+                known_put(&k, 0, UNKNOWN);
+                break;
+            case OP_EXT_CLR_END: case OP_EXT_CLR_BEGIN:
+                if (k.ptr_known) {
+                    changed++;
+                    if (k.ptr != (inst.type == OP_EXT_CLR_END ? tape_size - 1 : 0)) continue;
+                    if (known_get(&k, 0) == 0) continue;
+                    inst = (Instruction){OP_CLEAR, 0, 0, 0, 0, inst.src};
+                }
+                known_put(&k, 0, k.ptr_known ? 0 : known_get(&k, 0) == 0 ? 0 : UNKNOWN);
+                break;
+            default:
+                break;
+        }
+        ir[w++] = inst;
+    }
+    while (depth > 0) free(blocks[--depth].at.f);
+    free(k.f);
+    free(blocks);
+    loop_tree_free(&t);
+    ir_len = w;
+    return changed;
+}
+
+/*
+ * A store is dead when the same cell is overwritten before anything reads
+ * it. Only straight-line code is searched. A store the program ends with
+ * is kept: its cell may be off the tape, and then it has to fault.
+ */
+static int store_is_dead(int i) {
+    int cell = ir[i].type == OP_MUL || ir[i].type == OP_MUL2 ? ir[i].off + ir[i].val : ir[i].off;
+    for (int j = i + 1, pos = 0; j < ir_len && j < i + 64; j++) {
+        Instruction inst = ir[j];
+        int at = cell - pos;
+        switch (inst.type) {
+            case OP_MOVE: pos += inst.val; break;
+            case OP_SET: case OP_CLEAR: case OP_IN:
+                if (inst.off == at) return 1;
+                break;
+            case OP_ADD: case OP_OUT:
+                if (inst.off == at) return 0;
+                break;
+            case OP_OUTS:
+                break;
+            case OP_MUL:
+                if (inst.off == at || inst.off + inst.val == at) return 0;
+                break;
+            case OP_MUL2:
+                if (inst.off == at || inst.off + inst.val == at || inst.off + inst.val3 == at) return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+static int drop_dead_stores(void) {
+    int w = 0, changed = 0;
+    for (int i = 0; i < ir_len; i++) {
+        OpType t = ir[i].type;
+        if ((t == OP_ADD || t == OP_SET || t == OP_CLEAR || t == OP_MUL || t == OP_MUL2) && store_is_dead(i)) {
+            changed++;
+            continue;
+        }
+        ir[w++] = ir[i];
+    }
+    ir_len = w;
+    return changed;
+}
+
+static void propagate_values(void) {
+    for (int pass = 0; pass < 8; pass++) {
+        int changed = propagate();
+        changed += drop_dead_stores();
+        if (!changed) break;
+    }
+}
+
+/*
+ * Stack forwarding.
+ *
+ * The depth of each EXT stack is tracked as a range over the structured
+ * IR, starting empty: straight-line code shifts it (saturating at zero and
+ * the capacity), an if-block joins both paths, and a loop keeps its entry
+ * range when the body ends inside it, otherwise the bound that moved is
+ * widened to zero or the capacity. A push that cannot overflow and a pop
+ * that cannot underflow lose their checks, so a loop with a balanced body
+ * runs without any.
+ *
+ * Inside straight-line code a push that cannot fail is paired with the pop
+ * that takes its value back. A pointer pair becomes the move between the
+ * two points when that is known. A value pair becomes a copy through a
+ * temporary (OP_SAVE/OP_RESTORE), or goes away together with any writes to
+ * the cell in between when nothing reads the cell before the pop. The
+ * stack slot it used is dead: reading it again takes another push first.
+ */
+
+typedef struct {
+    uint32_t lo, hi;
+} Range;
+
+typedef struct {
+    Range v, p;
+} Depth;
+
+typedef struct {
+    int at;
+    long pos;
+    int epoch;
+} Pending;
+
+#define DEPTH_WORK (1L << 24)
+
+static long depth_work;
+
+static Range range_push(Range r) {
+    if (r.lo < tape_size) r.lo++;
+    if (r.hi < tape_size) r.hi++;
+    return r;
+}
+
+static Range range_pop(Range r) {
+    if (r.lo > 0) r.lo--;
+    if (r.hi > 0) r.hi--;
+    return r;
+}
+
+/* widen in to also cover out; 0 when it already does */
+static int range_widen(Range *in, Range out) {
+    int changed = 0;
+    if (out.lo < in->lo) { in->lo = 0; changed = 1; }
+    if (out.hi > in->hi) { in->hi = tape_size; changed = 1; }
+    return changed;
+}
+
+static Range range_join(Range a, Range b) {
+    return (Range){a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi};
+}
+
+/* at[i] = depth before stack op i; blocks without stack ops are skipped */
+static void walk_depth(int from, int to, Depth *d, Depth *at, const LoopTree *t) {
+    for (int i = from; i < to && depth_work >= 0; i++, depth_work--) {
+        at[i] = *d;
+        switch (ir[i].type) {
+            case OP_EXT_PUSH_V: d->v = range_push(d->v); break;
+            case OP_EXT_POP_V: d->v = range_pop(d->v); break;
+            case OP_EXT_PUSH_P: d->p = range_push(d->p); break;
+            case OP_EXT_POP_P: d->p = range_pop(d->p); break;
+            case OP_JZ: case OP_IF: {
+                int end = loop_end(t, i);
+                if (end < 0) break;
+                if (!(t->loop[t->at[i]].effects & LOOP_STACK)) { i = end; break; }
+                Depth in = *d, out;
+                do {
+                    out = in;
+                    walk_depth(i + 1, end, &out, at, t);
+                } while (ir[i].type == OP_JZ && (range_widen(&in.v, out.v) | range_widen(&in.p, out.p)));
+                if (ir[i].type == OP_JZ) *d = in;
+                else *d = (Depth){range_join(in.v, out.v), range_join(in.p, out.p)};
+                i = end;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Whether nothing between push i and its pop j reads the pushed cell.
+ * Writes to it in between are then dead, as the pop overwrites them; with
+ * drop set they are deleted.
+ */
+static int cell_unread(int i, int j, int drop) {
+    long pos = 0;
+    for (int k = i + 1; k < j; k++) {
+        Instruction *inst = &ir[k];
+        long at = -pos;
+        int writes = 0;
+        switch (inst->type) {
+            case OP_MOVE: pos += inst->val; break;
+            case OP_ADD: case OP_SET: case OP_CLEAR: case OP_RESTORE:
+                writes = inst->off == at;
+                break;
+            case OP_MUL: case OP_MUL2:
+                if (inst->off == at || (inst->type == OP_MUL2 && inst->off + inst->val3 == at)) return 0;
+                writes = inst->off + inst->val == at;
+                break;
+            case OP_EXT_CLR_END: case OP_EXT_CLR_BEGIN:
+                writes = at == 0;
+                break;
+            case OP_OUT: case OP_IN: case OP_SAVE:
+                if (inst->off == at) return 0;
+                break;
+            case OP_EXT_PUSH_V: case OP_EXT_POP_V:
+                if (at == 0) return 0;
+                break;
+            case OP_OUTS:
+                break;
+            default:
+                return 0;
+        }
+        if (writes && drop) *inst = (Instruction){OP_MOVE, 0};
+    }
+    return 1;
+}
+
+static void pair_stack_ops(void) {
+    Pending *vq = malloc(sizeof(Pending) * (ir_len + 1)), *pq = malloc(sizeof(Pending) * (ir_len + 1));
+    int vn = 0, pn = 0, epoch = 0;
+    long pos = 0;
+    for (int i = 0; i < ir_len; i++) {
+        Instruction *inst = &ir[i];
+        Pending q;
+        switch (inst->type) {
+            case OP_MOVE:
+                pos += inst->val;
+                break;
+            case OP_JZ: case OP_JNZ: case OP_IF: case OP_ENDIF:
+                vn = pn = 0;
+                /* fall through */
+            case OP_SCAN: case OP_EXT_PTR_MAX: case OP_EXT_PTR_ZERO:
+                epoch++;
+                pos = 0;
+                break;
+            case OP_EXT_PUSH_V:
+                if (inst->val2) vq[vn++] = (Pending){i, pos, epoch};
+                else vn = 0;
+                break;
+            case OP_EXT_POP_V:
+                if (vn == 0) break;
+                q = vq[--vn];
+                if (q.epoch == epoch && q.pos == pos && cell_unread(q.at, i, 0)) {
+                    cell_unread(q.at, i, 1);
+                    ir[q.at] = *inst = (Instruction){OP_MOVE, 0};
+                } else if (vn < STACK_TEMPS) {
+                    ir[q.at] = (Instruction){OP_SAVE, vn};
+                    *inst = (Instruction){OP_RESTORE, vn};
+                }
+                break;
+            case OP_EXT_PUSH_P:
+                if (inst->val2) pq[pn++] = (Pending){i, pos, epoch};
+                else pn = 0;
+                break;
+            case OP_EXT_POP_P:
+                if (pn == 0) { epoch++; pos = 0; break; }
+                q = pq[--pn];
+                if (q.epoch == epoch && q.pos - pos >= INT_MIN && q.pos - pos <= INT_MAX) {
+                    ir[q.at] = (Instruction){OP_MOVE, 0};
+                    *inst = (Instruction){OP_MOVE, q.pos - pos};
+                }
+                pos = q.pos;
+                epoch = q.epoch;
+                break;
+            default:
+                break;
+        }
+    }
+    free(vq);
+    free(pq);
+
+    /* merge the moves left behind */
+    int w = 0;
+    for (int i = 0; i < ir_len; i++) {
+        if (ir[i].type == OP_MOVE && w > 0 && ir[w - 1].type == OP_MOVE) {
+            ir[w - 1].val += ir[i].val;
+            if (ir[w - 1].val == 0) w--;
+            continue;
+        }
+        if (ir[i].type == OP_MOVE && ir[i].val == 0) continue;
+        ir[w++] = ir[i];
+    }
+    ir_len = w;
+}
+
+static void forward_stack(void) {
+    int stack_ops = 0;
+    for (int i = 0; i < ir_len; i++) {
+        OpType op = ir[i].type;
+        stack_ops |= op == OP_EXT_PUSH_V || op == OP_EXT_POP_V || op == OP_EXT_PUSH_P || op == OP_EXT_POP_P;
+    }
+    if (!stack_ops) return;
+    LoopTree t;
+    loop_tree(&t);
+    Depth *at = malloc(sizeof(Depth) * (ir_len + 1)), d = {{0, 0}, {0, 0}};
+    depth_work = DEPTH_WORK;
+    walk_depth(0, ir_len, &d, at, &t);
+    loop_tree_free(&t);
+
+    if (depth_work >= 0) {
+        for (int i = 0; i < ir_len; i++) {
+            Instruction *inst = &ir[i];
+            if (inst->type == OP_EXT_PUSH_V) inst->val2 = at[i].v.hi < tape_size;
+            else if (inst->type == OP_EXT_POP_V) inst->val2 = at[i].v.lo > 0;
+            else if (inst->type == OP_EXT_PUSH_P) inst->val2 = at[i].p.hi < tape_size;
+            else if (inst->type == OP_EXT_POP_P) inst->val2 = at[i].p.lo > 0;
+        }
+        pair_stack_ops();
+    }
+    free(at);
+}
+
+/*
+ * Pass manager. The pipeline runs in order; a step runs at its -O level
+ * and above unless its pass was turned off with -fno-<name>.
+ */
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    int off;
+} Pass;
+
+static Pass passes[] = {
+    {"linearize", optimize_ir},
+    {"fold-offsets", fold_offsets},
+    {"propagate", propagate_values},
+    {"forward-stack", forward_stack},
+};
+
+#define PASS_COUNT (int)(sizeof(passes) / sizeof(passes[0]))
+
+static const struct {
+    int pass;
+    int level;
+} pipeline[] = {
+    {0, 1}, {1, 1},
+    {2, 2}, {3, 2}, {1, 2}, {2, 2},
+};
+
+/* 0 when there is no such pass */
+int pass_disable(const char *name) {
+    for (int i = 0; i < PASS_COUNT; i++)
+        if (strcmp(passes[i].name, name) == 0) return passes[i].off = 1;
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_passes(int level, int stats) {
+    double total = 0;
+    for (size_t i = 0; i < sizeof(pipeline) / sizeof(pipeline[0]); i++) {
+        Pass *p = &passes[pipeline[i].pass];
+        if (pipeline[i].level > level || p->off) continue;
+        int before = ir_len;
+        double t0 = now();
+        p->run();
+        double t = now() - t0;
+        total += t;
+        if (stats) fprintf(stderr, "bfc: %-14s %9.3f ms %9d -> %d ops\n", p->name, t * 1e3, before, ir_len);
+    }
+    if (stats) fprintf(stderr, "bfc: %-14s %9.3f ms %9s    %d ops\n", "total", total * 1e3, "", ir_len);
+}
@@ -0,0 +1,1312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "arena.h"
+#include "pp.h"
+
+/*
+ * Every source is a span of memory read through p. Files are mapped (or
+ * read whole when they cannot be), macro bodies are borrowed as they are
+ * and only expansions built on the fly are owned. A source is replayed
+ * count times before it is popped.
+ */
+typedef struct Source {
+    const char *base, *p, *end;
+    char *owned;        /* freed on pop */
+    void *map;          /* unmapped on pop */
+    size_t map_len;
+    long count;
+    int annotated;      /* body of an annotated macro: emits the closing mark on pop */
+    int file;           /* see pp_locations(): file the text is written in, -1 for none */
+    long line0, line;   /* lines of base and of line_p */
+    const char *line_p;
+    const char *macro;  /* name of the macro this is the body of */
+    ArenaMark mark;     /* source_arena as it was before this source and its text */
+    struct Source *prev;
+} Source;
+
+typedef struct Macro {
+    char *body;
+    char *comment;
+    char **params;
+    int param_count;
+    int annotated;
+    int file;           /* where the body is written, -1 when not known */
+    long line;
+    struct Expansion *expansion;
+} Macro;
+
+/*
+ * Every name bfpp defines, documents or guards on is interned once in an
+ * open-addressing table; macros, comments and {S} guards hang off the
+ * symbol. Symbols are never removed, {U} only drops the macro.
+ */
+typedef struct Symbol {
+    char *name;
+    size_t len;
+    unsigned hash;
+    Macro *macro;
+    int guarded;
+    char *path;         /* {LOAD} argument resolved to a file */
+    int touched;        /* defined, documented, undefined or guarded while recording a .bfpch */
+    int external;       /* looked up while recording before the header set it */
+    int annotated;      /* expansions are bracketed by origin marks for bfc, see pp_annotate() */
+    unsigned long gen;  /* bumped whenever the macro, comment or guard changes */
+    unsigned long mark;
+} Symbol;
+
+/*
+ * What a parameterless macro expanded to the last time, with every symbol
+ * the expansion looked up and that symbol's generation then. The text is
+ * reused as long as none of them changed.
+ */
+typedef struct Expansion {
+    char *text;
+    size_t len;
+    Symbol **deps;
+    unsigned long *gens;
+    int dep_count;
+} Expansion;
+
+/*
+ * An expansion being recorded: its text and lookups are the tail of
+ * memo_text and memo_deps from the offsets it started at. It fails on
+ * anything with side effects, on outgrowing MEMO_MAX, or when its body
+ * runs out in the middle of a construct that goes on reading the source
+ * underneath; a failure also fails every memo it is nested in.
+ */
+typedef struct Memo {
+    Macro *macro;
+    struct Source *src;
+    size_t text_start, dep_start;
+    int failed;
+    struct Memo *prev;
+} Memo;
+
+#define MEMO_MAX (1 << 20)
+
+static Source *src_stack = NULL;
+
+/*
+ * Sources, the text built for them and their memos only live until the
+ * source is popped, which is always in reverse order, so they come from
+ * one arena that each pop rolls back. Words and bodies read by a
+ * directive come from tokens, which is emptied before every character
+ * process() reads.
+ */
+static Arena source_arena, tokens;
+static Symbol **symbols = NULL;
+static size_t sym_cap = 0, sym_count = 0;
+
+static PpSink sink = NULL;
+static void *sink_ctx = NULL;
+
+/* set while writing a .bfpch: everything the header does is recorded */
+static int pch_recording = 0;
+static char *captured = NULL;
+static size_t captured_len = 0, captured_cap = 0;
+typedef struct Dep {
+    char *arg;          /* {LOAD} argument, NULL for the header itself */
+    char *path;
+} Dep;
+static Dep *deps = NULL;
+static int dep_count = 0;
+
+static Memo *memo_stack = NULL;
+static char *memo_text = NULL;
+static size_t memo_text_len = 0, memo_text_cap = 0;
+static Symbol **memo_deps = NULL;
+static unsigned long *memo_gens = NULL;
+static size_t memo_dep_len = 0, memo_dep_cap = 0;
+static unsigned long memo_mark = 0;
+static int top_level_read = 0;     /* set around process()'s own get_char() */
+
+static char *line_buf = NULL;
+static size_t lb_len = 0;
+static size_t lb_cap = 0;
+static int line_has_content = 0;
+
+static int locations = 0;
+static int file_count = 0;
+static int prev_char, prev_char2;      /* last two characters emitted, to keep EXT ops whole */
+static char *loc_mark = NULL, *loc_last = NULL;
+static size_t loc_cap = 0;
+
+static void memo_fail(Memo *m) {
+    for (; m; m = m->prev) m->failed = 1;
+}
+
+static void memo_dep(Symbol *sym) {
+    if (memo_dep_len == memo_dep_cap) {
+        memo_dep_cap = memo_dep_cap ? memo_dep_cap * 2 : 256;
+        memo_deps = realloc(memo_deps, sizeof(Symbol *) * memo_dep_cap);
+        memo_gens = realloc(memo_gens, sizeof(unsigned long) * memo_dep_cap);
+    }
+    memo_deps[memo_dep_len] = sym;
+    memo_gens[memo_dep_len++] = sym->gen;
+}
+
+static void free_expansion(Macro *m) {
+    if (!m->expansion) return;
+    free(m->expansion->text);
+    free(m->expansion->deps);
+    free(m->expansion->gens);
+    free(m->expansion);
+    m->expansion = NULL;
+}
+
+static int expansion_valid(const Expansion *e) {
+    for (int i = 0; i < e->dep_count; i++)
+        if (e->deps[i]->gen != e->gens[i]) return 0;
+    return 1;
+}
+
+/* the body source has run out: keep what it expanded to if that was clean */
+static void memo_end(int clean) {
+    Memo *m = memo_stack;
+    memo_stack = m->prev;
+    if (!clean) memo_fail(m);
+    if (!m->failed) {
+        Expansion *e = calloc(1, sizeof(Expansion));
+        e->len = memo_text_len - m->text_start;
+        e->text = malloc(e->len + 1);
+        if (e->len) memcpy(e->text, memo_text + m->text_start, e->len);
+        e->deps = malloc(sizeof(Symbol *) * (memo_dep_len - m->dep_start + 1));
+        e->gens = malloc(sizeof(unsigned long) * (memo_dep_len - m->dep_start + 1));
+        memo_mark++;
+        for (size_t i = m->dep_start; i < memo_dep_len; i++) {
+            if (memo_deps[i]->mark == memo_mark) continue;
+            memo_deps[i]->mark = memo_mark;
+            e->deps[e->dep_count] = memo_deps[i];
+            e->gens[e->dep_count++] = memo_gens[i];
+        }
+        free_expansion(m->macro);
+        m->macro->expansion = e;
+    }
+    if (!memo_stack || memo_stack->failed) memo_text_len = memo_dep_len = 0;
+}
+
+/*
+ * Blank lines are dropped. Once a line is known to have content it is
+ * handed to the sink in pieces, so a long expansion is never held whole.
+ */
+static void emit_char(int c) {
+    prev_char2 = prev_char;
+    prev_char = c;
+    if (pch_recording) {
+        if (captured_len == captured_cap) captured = realloc(captured, captured_cap = captured_cap ? captured_cap * 2 : 256);
+        captured[captured_len++] = c;
+    }
+    if (memo_stack && !memo_stack->failed) {
+        if (memo_text_len == memo_text_cap) memo_text = realloc(memo_text, memo_text_cap = memo_text_cap ? memo_text_cap * 2 : 4096);
+        memo_text[memo_text_len++] = c;
+        if (memo_text_len - memo_stack->text_start > MEMO_MAX) memo_fail(memo_stack);
+    }
+    if (lb_cap == 0) {
+        lb_cap = 4096;
+        line_buf = malloc(lb_cap);
+    }
+    if (c == '\n') {
+        if (line_has_content) {
+            line_buf[lb_len++] = '\n';
+            sink(line_buf, lb_len, sink_ctx);
+        }
+        lb_len = 0;
+        line_has_content = 0;
+    } else {
+        if (lb_len + 2 >= lb_cap) {
+            if (line_has_content) {
+                sink(line_buf, lb_len, sink_ctx);
+                lb_len = 0;
+            } else {
+                lb_cap *= 2;
+                line_buf = realloc(line_buf, lb_cap);
+            }
+        }
+        line_buf[lb_len++] = c;
+        if (!isspace(c)) {
+            line_has_content = 1;
+        }
+    }
+}
+
+static void emit_string(const char *s) {
+    while (*s) emit_char(*s++);
+}
+
+/* emit_char() over n bytes, copying the rest of a line with content whole */
+static void emit_span(const char *s, size_t n) {
+    while (n > 0) {
+        if (pch_recording || locations || !line_has_content || (memo_stack && !memo_stack->failed)) {
+            emit_char(*s++);
+            n--;
+            continue;
+        }
+        const char *nl = memchr(s, '\n', n);
+        size_t k = nl ? (size_t)(nl - s) : n;
+        if (lb_len + k + 2 >= lb_cap) {
+            sink(line_buf, lb_len, sink_ctx);
+            lb_len = 0;
+            if (k + 2 >= lb_cap) {
+                sink(s, k, sink_ctx);
+                s += k;
+                n -= k;
+                k = 0;
+            }
+        }
+        memcpy(line_buf + lb_len, s, k);
+        lb_len += k;
+        s += k;
+        n -= k;
+        if (nl) { emit_char('\n'); s++; n--; }
+    }
+}
+
+static void flush_output() {
+    if (lb_len > 0 && line_has_content) {
+        line_buf[lb_len++] = '\n';
+        sink(line_buf, lb_len, sink_ctx);
+    }
+    lb_len = 0;
+    line_has_content = 0;
+}
+
+/*
+ * Source locations. With pp_locations() on, every file gets an id, declared
+ * by a comment "#ID=PATH" when it is opened, and a comment
+ * "#CF:CL TF:TL OUTER>...>INNER" goes before each op whose origin differs
+ * from the op before: CF:CL is the line of the file the code was written
+ * in at the top level, TF:TL where the op's own text is (inside a macro's
+ * definition for an expansion) and then the macros it was expanded from.
+ * Expansions are not memoized and .bfpch files are not used meanwhile.
+ */
+typedef struct {
+    int file;
+    long line;
+} Pos;
+
+static long source_line(Source *s) {
+    if (s->p < s->line_p) {
+        s->line_p = s->base;
+        s->line = s->line0;
+    }
+    for (; s->line_p < s->p; s->line_p++) s->line += *s->line_p == '\n';
+    return s->line;
+}
+
+/* where the text being read is written */
+static Pos text_pos() {
+    for (Source *s = src_stack; s; s = s->prev)
+        if (s->file >= 0) return (Pos){s->file, source_line(s)};
+    return (Pos){-1, 0};
+}
+
+static void mark_printf(size_t *len, const char *fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(loc_mark + *len, loc_cap - *len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < loc_cap - *len) { *len += n; return; }
+        size_t cap = loc_cap ? loc_cap * 2 : 256;
+        loc_mark = realloc(loc_mark, cap);
+        loc_last = realloc(loc_last, cap);
+        if (!loc_cap) loc_last[0] = 0;
+        loc_cap = cap;
+    }
+}
+
+/* before an op: the mark for its origin, unless the last one still holds */
+static void mark_location() {
+    Source *top = src_stack;
+    while (top && (top->file < 0 || top->macro)) top = top->prev;
+    if (!top) return;
+    Pos at = text_pos();
+    size_t len = 0;
+    int n = 0;
+    mark_printf(&len, "/*#%d:%ld %d:%ld", top->file, source_line(top), at.file, at.line);
+    for (Source *s = src_stack; s != top; s = s->prev) n += s->macro != NULL;
+    const char **names = arena_alloc(&tokens, sizeof(char *) * (n + 1));
+    n = 0;
+    for (Source *s = src_stack; s != top; s = s->prev) if (s->macro) names[n++] = s->macro;
+    for (int k = n - 1; k >= 0; k--) mark_printf(&len, "%c%s", k == n - 1 ? ' ' : '>', names[k]);
+    mark_printf(&len, "*/");
+    if (strcmp(loc_mark, loc_last) == 0) return;
+    emit_string(loc_mark);
+    memcpy(loc_last, loc_mark, len + 1);
+}
+
+static void push_span(ArenaMark mark, const char *base, size_t len, char *owned, long count) {
+    Source *s = arena_alloc(&source_arena, sizeof(Source));
+    *s = (Source){0};
+    s->file = -1;
+    s->mark = mark;
+    s->base = s->p = base;
+    s->end = base + len;
+    s->owned = owned;
+    s->count = count;
+    s->prev = src_stack;
+    src_stack = s;
+}
+
+/* the source just pushed is filename, which gets the next file id */
+static void place_file(const char *filename) {
+    if (!locations) return;
+    char id[32];
+    snprintf(id, sizeof(id), "/*#%d=", file_count);
+    emit_string(id);
+    emit_string(filename ? filename : "<stdin>");
+    emit_string("*/");
+    src_stack->file = file_count++;
+    src_stack->line0 = src_stack->line = 1;
+    src_stack->line_p = src_stack->base;
+}
+
+/* stdin when filename is NULL */
+static void push_file(const char *filename) {
+    FILE *f = filename ? fopen(filename, "rb") : stdin;
+    if (!f) { fprintf(stderr, "Error opening file: %s\n", filename); exit(1); }
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map != MAP_FAILED) {
+            if (f != stdin) fclose(f);
+            push_span(arena_mark(&source_arena), map, st.st_size, NULL, 1);
+            src_stack->map = map;
+            src_stack->map_len = st.st_size;
+            place_file(filename);
+            return;
+        }
+    }
+    char *data = NULL;
+    size_t len = 0, cap = 0, got;
+    do {
+        if (len == cap) data = realloc(data, cap = cap ? cap * 2 : 65536);
+        len += got = fread(data + len, 1, cap - len, f);
+    } while (got > 0);
+    if (f != stdin) fclose(f);
+    push_span(arena_mark(&source_arena), data, len, data, 1);
+    place_file(filename);
+}
+
+/* borrows str, which must stay alive until the source is popped (see release_body) */
+static void push_string(const char *str) {
+    push_span(arena_mark(&source_arena), str, strlen(str), NULL, 1);
+}
+
+/* replays str, built in source_arena after mark, count times by rewinding */
+static void push_repeat(ArenaMark mark, const char *str, long count) {
+    push_span(mark, str, strlen(str), NULL, count);
+}
+
+static void pop_source() {
+    if (!src_stack) return;
+    Source *s = src_stack;
+    src_stack = s->prev;
+    while (memo_stack && memo_stack->src == s) memo_end(top_level_read);
+    if (s->annotated) emit_string("/*@*/");
+    if (s->map) munmap(s->map, s->map_len);
+    free(s->owned);
+    arena_release(&source_arena, s->mark);
+}
+
+/*
+ * Frees a macro body that is being replaced, unless a source is still
+ * reading it: then the outermost such source takes it over.
+ */
+static void release_body(char *body) {
+    Source *reader = NULL;
+    for (Source *s = src_stack; s; s = s->prev)
+        if (s->base == body && !s->owned) reader = s;
+    if (reader) reader->owned = body;
+    else free(body);
+}
+
+static int get_char() {
+    Source *s;
+    while ((s = src_stack)) {
+        if (s->p < s->end) return (unsigned char)*s->p++;
+        if (--s->count > 0 && s->end > s->base) s->p = s->base;
+        else pop_source();
+    }
+    return EOF;
+}
+
+/* lookahead stays within the current source */
+static int peek_char() {
+    Source *s = src_stack;
+    if (!s) return EOF;
+    if (s->p < s->end) return (unsigned char)*s->p;
+    if (s->count > 1 && s->end > s->base) return (unsigned char)*s->base;
+    return EOF;
+}
+
+static void consume_until_brace() {
+    while(1) {
+        int c = get_char();
+        if (c == '}' || c == EOF) break;
+    }
+}
+
+static unsigned hash_name(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static Symbol **sym_slot(Symbol **table, size_t cap, const char *s, size_t len, unsigned h) {
+    size_t i = h & (cap - 1);
+    while (table[i] && (table[i]->hash != h || table[i]->len != len || memcmp(table[i]->name, s, len) != 0)) i = (i + 1) & (cap - 1);
+    return &table[i];
+}
+
+static Symbol *lookup_n(const char *s, size_t len) {
+    if (sym_count == 0) return NULL;
+    return *sym_slot(symbols, sym_cap, s, len, hash_name(s, len));
+}
+
+static Symbol *intern_n(const char *s, size_t len) {
+    unsigned h = hash_name(s, len);
+    if ((sym_count + 1) * 4 > sym_cap * 3) {
+        size_t cap = sym_cap ? sym_cap * 2 : 256;
+        Symbol **table = calloc(cap, sizeof(Symbol *));
+        for (size_t i = 0; i < sym_cap; i++) {
+            if (symbols[i]) *sym_slot(table, cap, symbols[i]->name, symbols[i]->len, symbols[i]->hash) = symbols[i];
+        }
+        free(symbols);
+        symbols = table;
+        sym_cap = cap;
+    }
+    Symbol **slot = sym_slot(symbols, sym_cap, s, len, h);
+    if (!*slot) {
+        *slot = calloc(1, sizeof(Symbol));
+        (*slot)->name = strndup(s, len);
+        (*slot)->len = len;
+        (*slot)->hash = h;
+        sym_count++;
+    }
+    return *slot;
+}
+
+static Symbol *intern(const char *s) {
+    return intern_n(s, strlen(s));
+}
+
+/* the source just pushed is the body of macro m, called name */
+static void place_body(Macro *m, const char *name, size_t len) {
+    if (!locations) return;
+    src_stack->macro = intern_n(name, len)->name;
+    src_stack->file = m->file;
+    src_stack->line0 = src_stack->line = m->line;
+    src_stack->line_p = src_stack->base;
+}
+
+/* name was just defined with its body written at at */
+static void place_macro(const char *name, Pos at) {
+    Symbol *sym = lookup_n(name, strlen(name));
+    if (sym && sym->macro) {
+        sym->macro->file = at.file;
+        sym->macro->line = at.line;
+    }
+}
+
+/* a lookup the recorded header did not answer itself makes it depend on the includer */
+static Symbol *lookup_recorded(const char *name, size_t len) {
+    Symbol *sym = lookup_n(name, len);
+    if (pch_recording && (!sym || !sym->touched)) {
+        sym = intern_n(name, len);
+        sym->external = 1;
+    }
+    if (memo_stack && !memo_stack->failed) {
+        if (!sym) sym = intern_n(name, len);
+        if (memo_dep_len - memo_stack->dep_start < MEMO_MAX) memo_dep(sym);
+        else memo_fail(memo_stack);
+    }
+    return sym;
+}
+
+static Macro *symbol_macro(const char *name) {
+    Symbol *sym = pch_recording ? lookup_recorded(name, strlen(name)) : intern(name);
+    sym->touched = 1;
+    sym->gen++;
+    if (!sym->macro) {
+        sym->macro = calloc(1, sizeof(Macro));
+        sym->macro->annotated = sym->annotated;
+        sym->macro->file = -1;
+    }
+    return sym->macro;
+}
+
+static void define_macro_base(const char *name, const char *body, char **params, int param_count) {
+    Macro *m = symbol_macro(name);
+    if (m->body) release_body(m->body);
+    m->body = strdup(body);
+    free_expansion(m);
+    if (m->params) {
+        for(int i=0; i<m->param_count; i++) free(m->params[i]);
+        free(m->params);
+    }
+    m->params = params;
+    m->param_count = param_count;
+}
+
+static void define_macro(const char *name, const char *body) {
+    define_macro_base(name, body, NULL, 0);
+}
+
+static void define_macro_comment(const char *name, const char *comment) {
+    Macro *m = symbol_macro(name);
+    if (m->comment) free(m->comment);
+    m->comment = strdup(comment);
+}
+
+static void undef_macro(char *name) {
+    Symbol *sym = pch_recording ? intern(name) : lookup_n(name, strlen(name));
+    if (sym) sym->touched = 1;
+    if (!sym || !sym->macro) return;
+    Macro *temp = sym->macro;
+    sym->macro = NULL;
+    sym->gen++;
+    free_expansion(temp);
+    if (temp->body) release_body(temp->body);
+    if (temp->comment) free(temp->comment);
+    if (temp->params) {
+        for(int i=0; i<temp->param_count; i++) free(temp->params[i]);
+        free(temp->params);
+    }
+    free(temp);
+}
+
+static Macro *find_macro_n(const char *name, size_t len) {
+    Symbol *sym = lookup_recorded(name, len);
+    return sym ? sym->macro : NULL;
+}
+
+static Macro *find_macro(const char *name) {
+    return find_macro_n(name, strlen(name));
+}
+
+static void add_guard(const char *name) {
+    Symbol *sym = intern(name);
+    sym->guarded = 1;
+    sym->touched = 1;
+    sym->gen++;
+}
+
+static int is_guarded(const char *name) {
+    Symbol *sym = lookup_recorded(name, strlen(name));
+    return sym && sym->guarded;
+}
+
+/* next identifier in a buffer reused between calls, for the hot token path */
+static const char *scan_word(size_t *len) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    size_t n = 0;
+    int c;
+    while (isalnum(c = peek_char()) || c == '_') {
+        get_char();
+        if (n + 1 >= cap) buf = realloc(buf, cap = cap ? cap * 2 : 64);
+        buf[n++] = c;
+    }
+    if (!buf) buf = realloc(buf, cap = 64);
+    buf[n] = 0;
+    *len = n;
+    return buf;
+}
+
+static char *read_word() {
+    size_t cap = 16, len = 0;
+    char *buf = arena_alloc(&tokens, cap);
+    int c;
+    while (isalnum(c = peek_char()) || c == '_') {
+        get_char();
+        if (len + 1 >= cap) buf = arena_grow(&tokens, buf, cap, cap * 2), cap *= 2;
+        buf[len++] = c;
+    }
+    buf[len] = 0;
+    return buf;
+}
+
+static void skip_whitespace() {
+    while (isspace(peek_char())) get_char();
+}
+
+static char *read_definition_body() {
+    skip_whitespace();
+    size_t cap = 64, len = 0;
+    char *buf = arena_alloc(&tokens, cap);
+    int depth = 1;
+    while (1) {
+        int c = get_char();
+        if (c == EOF) break;
+        if (c == '{') depth++;
+        if (c == '}') {
+            depth--;
+            if (depth == 0) break;
+        }
+        if (len + 2 >= cap) buf = arena_grow(&tokens, buf, cap, cap * 2), cap *= 2;
+        buf[len++] = c;
+    }
+    buf[len] = 0;
+    return buf;
+}
+
+static char **read_decl_params(int *count) {
+    skip_whitespace();
+    if (peek_char() != '(') { *count = 0; return NULL; }
+    get_char();
+    
+    char **params = NULL;
+    int cap = 4;
+    int cnt = 0;
+    params = malloc(sizeof(char*) * cap);
+
+    while (1) {
+        skip_whitespace();
+        if (peek_char() == ')') { get_char(); break; }
+        
+        char *pname = read_word();
+        if (strlen(pname) > 0) {
+            if (cnt >= cap) params = realloc(params, sizeof(char*) * (cap *= 2));
+            params[cnt++] = strdup(pname);
+        }
+
+        skip_whitespace();
+        if (peek_char() == ',') get_char();
+        else if (peek_char() == ')') { get_char(); break; }
+    }
+    *count = cnt;
+    return params;
+}
+
+static char *trim_string(char *str) {
+    char *end;
+    while(isspace((unsigned char)*str)) str++;
+    if(*str == 0) return arena_strndup(&tokens, "", 0);
+    end = str + strlen(str) - 1;
+    while(end > str && isspace((unsigned char)*end)) end--;
+    return arena_strndup(&tokens, str, end + 1 - str);
+}
+
+static char **read_call_args(int expected_count) {
+    skip_whitespace();
+    if (peek_char() != '(') return NULL;
+    get_char();
+
+    char **args = arena_alloc(&tokens, sizeof(char*) * expected_count);
+    for(int i=0; i<expected_count; i++) args[i] = NULL;
+    
+    int idx = 0;
+    size_t cap = 64, len = 0;
+    char *buf = arena_alloc(&tokens, cap);
+    int depth_brace = 0;
+    int depth_paren = 0;
+
+    while (1) {
+        int c = get_char();
+        if (c == EOF) break;
+        
+        if (depth_brace == 0 && depth_paren == 0 && (c == ',' || c == ')')) {
+            buf[len] = 0;
+            if (idx < expected_count) {
+                args[idx++] = trim_string(buf);
+            }
+            len = 0;
+            if (c == ')') break;
+        } else {
+            if (c == '{') depth_brace++;
+            else if (c == '}') { if(depth_brace > 0) depth_brace--; }
+            else if (c == '(') depth_paren++;
+            else if (c == ')') { if(depth_paren > 0) depth_paren--; }
+
+            if (len + 2 >= cap) buf = arena_grow(&tokens, buf, cap, cap * 2), cap *= 2;
+            buf[len++] = c;
+        }
+    }
+    return args;
+}
+
+static int is_subst_word_char(char c) {
+    return (isalnum(c) || c == '_') && c != 'x';
+}
+
+static char *substitute_args(const char *body, char **param_names, char **args, int count) {
+    size_t cap = strlen(body) * 2 + 1;
+    if (cap < 64) cap = 64;
+    size_t len = 0;
+    char *res = arena_alloc(&source_arena, cap);
+    
+    const char *p = body;
+    while (*p) {
+        if (is_subst_word_char(*p)) {
+            const char *start = p;
+            while (is_subst_word_char(*p)) p++;
+            size_t wlen = p - start;
+            
+            int found_idx = -1;
+            for (int i = 0; i < count; i++) {
+                if (strlen(param_names[i]) == wlen && memcmp(start, param_names[i], wlen) == 0) {
+                    found_idx = i;
+                    break;
+                }
+            }
+
+            const char *sub = (found_idx != -1) ? args[found_idx] : start;
+            size_t slen = (found_idx != -1) ? strlen(sub) : wlen;
+            
+            while (len + slen >= cap) res = arena_grow(&source_arena, res, cap, cap * 2), cap *= 2;
+            memcpy(res + len, sub, slen);
+            len += slen;
+        } else {
+            if (len + 1 >= cap) res = arena_grow(&source_arena, res, cap, cap * 2), cap *= 2;
+            res[len++] = *p++;
+        }
+    }
+    res[len] = 0;
+    return res;
+}
+
+static char *read_path_until_brace() {
+    skip_whitespace();
+    size_t cap = 64, len = 0;
+    char *buf = arena_alloc(&tokens, cap);
+    int c;
+    while ((c = peek_char()) != '}' && c != EOF) {
+        get_char();
+        if (len + 1 >= cap) {
+            buf = arena_grow(&tokens, buf, cap, cap * 2);
+            cap *= 2;
+        }
+        buf[len++] = c;
+    }
+    buf[len] = '\0';
+    while (len > 0 && isspace(buf[len - 1])) {
+        buf[--len] = '\0';
+    }
+    return buf;
+}
+
+static char *probe_path(const char *arg) {
+    if (arg[0] == '"') {
+        size_t len = strlen(arg);
+        if (len >= 2 && arg[len - 1] == '"') {
+            char *path = strdup(arg + 1);
+            path[len - 2] = '\0';
+            return path;
+        }
+        return strdup(arg);
+    }
+    char *bfpp = getenv("BFPP");
+    if (bfpp) {
+        char *paths = strdup(bfpp);
+        size_t len = strlen(paths);
+        while (len > 0 && isspace((unsigned char)paths[len - 1])) paths[--len] = '\0';
+        char *token = strtok(paths, ":");
+        while (token) {
+            size_t needed = strlen(token) + 1 + strlen(arg) + 1;
+            char *full_path = malloc(needed);
+            sprintf(full_path, "%s/%s", token, arg);
+            if (access(full_path, R_OK) == 0) {
+                free(paths);
+                return full_path;
+            }
+            free(full_path);
+            token = strtok(NULL, ":");
+        }
+        free(paths);
+    }
+    if (access(arg, R_OK) == 0) return strdup(arg);
+    return NULL;
+}
+
+/* $BFPP is probed once per distinct {LOAD} argument */
+static char *resolve_path(const char *arg) {
+    Symbol *sym = intern(arg);
+    if (!sym->path) sym->path = probe_path(arg);
+    return sym->path ? strdup(sym->path) : NULL;
+}
+
+/*
+ * Precompiled headers. `bfpp --pch header` runs the header on its own and
+ * stores what it did next to it as header.bfpch: every file it loaded,
+ * the names it looked up without defining them first, the final state of
+ * every symbol it defined, documented, undefined or guarded, and the text
+ * it emitted. {LOAD} replays that instead of parsing when the files are
+ * unchanged (same mtime and size, or failing that the same contents), the
+ * nested loads still resolve to the same files, and none of the looked up
+ * names has a macro or guard yet.
+ */
+#define PCH_MAGIC "BFPCH1\n"
+
+static uint64_t file_hash(const char *path) {
+    FILE *f = fopen(path, "rb");
+    uint64_t h = 0xCBF29CE484222325ULL;
+    if (!f) return 0;
+    int c;
+    while ((c = getc(f)) != EOF) h = (h ^ (unsigned char)c) * 0x100000001B3ULL;
+    fclose(f);
+    return h;
+}
+
+static void record_dep(const char *arg, const char *path) {
+    deps = realloc(deps, sizeof(Dep) * (dep_count + 1));
+    deps[dep_count].arg = arg ? strdup(arg) : NULL;
+    deps[dep_count++].path = realpath(path, NULL);
+}
+
+static void put_u64(FILE *f, uint64_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void put_str(FILE *f, const char *s, size_t len) {
+    put_u64(f, s ? len : UINT64_MAX);
+    if (s) fwrite(s, 1, len, f);
+}
+
+typedef struct Reader {
+    const char *p, *end;
+    int bad;
+} Reader;
+
+static uint64_t get_u64(Reader *r) {
+    uint64_t v = 0;
+    if (r->end - r->p < (long)sizeof(v)) { r->bad = 1; return 0; }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+/* NULL for an absent string; *len is set when non-NULL */
+static const char *get_str(Reader *r, size_t *len) {
+    uint64_t n = get_u64(r);
+    if (r->bad || n == UINT64_MAX) return NULL;
+    if ((uint64_t)(r->end - r->p) < n) { r->bad = 1; return NULL; }
+    const char *s = r->p;
+    r->p += n;
+    if (len) *len = n;
+    return s;
+}
+
+static char *get_strdup(Reader *r) {
+    size_t len = 0;
+    const char *s = get_str(r, &len);
+    return s ? strndup(s, len) : NULL;
+}
+
+static int deps_unchanged(Reader *r) {
+    uint64_t n = get_u64(r);
+    for (uint64_t i = 0; i < n && !r->bad; i++) {
+        char *arg = get_strdup(r), *path = get_strdup(r);
+        uint64_t mtime = get_u64(r), size = get_u64(r), hash = get_u64(r);
+        int ok = !r->bad && path;
+        struct stat st;
+        if (ok && arg) {
+            char *resolved = resolve_path(arg), *real = resolved ? realpath(resolved, NULL) : NULL;
+            ok = real && strcmp(real, path) == 0;
+            free(resolved); free(real);
+        }
+        if (ok && (stat(path, &st) != 0 || (uint64_t)st.st_mtime != mtime || (uint64_t)st.st_size != size))
+            ok = file_hash(path) == hash;
+        free(arg); free(path);
+        if (!ok) return 0;
+    }
+    return !r->bad;
+}
+
+static int externals_unset(Reader *r) {
+    uint64_t n = get_u64(r);
+    for (uint64_t i = 0; i < n && !r->bad; i++) {
+        size_t len = 0;
+        const char *name = get_str(r, &len);
+        Symbol *sym = name ? lookup_n(name, len) : NULL;
+        if (sym && (sym->macro || sym->guarded)) return 0;
+    }
+    return !r->bad;
+}
+
+/* walks the symbol records, applying them only once they are known to be intact */
+static int read_symbols(Reader *r, int apply) {
+    uint64_t n = get_u64(r);
+    for (uint64_t i = 0; i < n && !r->bad; i++) {
+        char *name = get_strdup(r);
+        uint64_t flags = get_u64(r);
+        char *body = NULL, *comment = NULL, **params = NULL;
+        uint64_t param_count = 0;
+        if (flags & 1) {
+            body = get_strdup(r);
+            comment = get_strdup(r);
+            param_count = get_u64(r);
+            if (param_count > (uint64_t)(r->end - r->p)) r->bad = 1;
+            else if (param_count) params = calloc(param_count, sizeof(char *));
+            for (uint64_t j = 0; j < param_count && !r->bad; j++) params[j] = get_strdup(r);
+        }
+        if (apply && name) {
+            undef_macro(name);
+            if (flags & 1) {
+                Macro *m = symbol_macro(name);
+                m->body = body;
+                m->comment = comment;
+                m->params = params;
+                m->param_count = param_count;
+                body = comment = NULL;
+                params = NULL;
+            }
+            if (flags & 2) add_guard(name);
+        }
+        if (params) for (uint64_t j = 0; j < param_count; j++) free(params[j]);
+        free(params); free(body); free(comment); free(name);
+    }
+    return !r->bad;
+}
+
+static int load_pch(const char *header) {
+    if (pch_recording || locations) return 0;
+    char *path = malloc(strlen(header) + 7);
+    sprintf(path, "%s.bfpch", header);
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) return 0;
+    struct stat st;
+    char *data = NULL;
+    int ok = fstat(fileno(f), &st) == 0 && (data = malloc(st.st_size + 1))
+          && fread(data, 1, st.st_size, f) == (size_t)st.st_size;
+    fclose(f);
+    Reader r = {data, data + st.st_size, 0};
+    ok = ok && st.st_size >= (off_t)strlen(PCH_MAGIC) && memcmp(data, PCH_MAGIC, strlen(PCH_MAGIC)) == 0;
+    r.p += strlen(PCH_MAGIC);
+    ok = ok && deps_unchanged(&r) && externals_unset(&r);
+    const char *symbols_at = r.p;
+    ok = ok && read_symbols(&r, 0);
+    size_t out_len = 0;
+    const char *out = ok ? get_str(&r, &out_len) : NULL;
+    if (ok && !r.bad && out) {
+        r.p = symbols_at;
+        read_symbols(&r, 1);
+        for (size_t i = 0; i < out_len; i++) emit_char(out[i]);
+    } else ok = 0;
+    free(data);
+    return ok;
+}
+
+static void write_pch(const char *header) {
+    char *path = malloc(strlen(header) + 16);
+    sprintf(path, "%s.bfpch.%d", header, (int)getpid());
+    FILE *f = fopen(path, "wb");
+    if (!f) { fprintf(stderr, "Error writing file: %s\n", path); exit(1); }
+    fputs(PCH_MAGIC, f);
+    put_u64(f, dep_count);
+    for (int i = 0; i < dep_count; i++) {
+        struct stat st = {0};
+        stat(deps[i].path, &st);
+        put_str(f, deps[i].arg, deps[i].arg ? strlen(deps[i].arg) : 0);
+        put_str(f, deps[i].path, strlen(deps[i].path));
+        put_u64(f, st.st_mtime);
+        put_u64(f, st.st_size);
+        put_u64(f, file_hash(deps[i].path));
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < sym_cap; i++) n += symbols[i] && symbols[i]->external;
+    put_u64(f, n);
+    for (size_t i = 0; i < sym_cap; i++)
+        if (symbols[i] && symbols[i]->external) put_str(f, symbols[i]->name, symbols[i]->len);
+    n = 0;
+    for (size_t i = 0; i < sym_cap; i++) n += symbols[i] && symbols[i]->touched;
+    put_u64(f, n);
+    for (size_t i = 0; i < sym_cap; i++) {
+        Symbol *sym = symbols[i];
+        if (!sym || !sym->touched) continue;
+        Macro *m = sym->macro;
+        put_str(f, sym->name, sym->len);
+        put_u64(f, (m ? 1 : 0) | (sym->guarded ? 2 : 0));
+        if (!m) continue;
+        put_str(f, m->body, m->body ? strlen(m->body) : 0);
+        put_str(f, m->comment, m->comment ? strlen(m->comment) : 0);
+        put_u64(f, m->param_count);
+        for (int j = 0; j < m->param_count; j++) put_str(f, m->params[j], strlen(m->params[j]));
+    }
+    put_str(f, captured ? captured : "", captured_len);
+    char *final = strndup(path, strrchr(path, '.') - path);
+    if (fclose(f) != 0 || rename(path, final) != 0) {
+        fprintf(stderr, "Error writing file: %s\n", final);
+        unlink(path);
+        exit(1);
+    }
+    free(final);
+    free(path);
+}
+
+static void print_sanitized_string(const char *str) {
+    emit_string("/* ");
+    while (*str) {
+        if (strchr("+-<>.,[]", *str)) emit_char('?');
+        else emit_char(*str);
+        str++;
+    }
+    emit_string(" */");
+}
+
+static char *find_macro_comment(const char *name) {
+    Macro *m = find_macro(name);
+    return m ? m->comment : NULL;
+}
+
+static void print_macro_debug(const char *name) {
+    Macro *m = find_macro(name);
+    emit_string("/* expanded from "); emit_string(name); emit_string(" */");
+}
+
+static char *expand_macros_once(const char *input) {
+    size_t cap = strlen(input) * 2 + 1; 
+    if (cap < 64) cap = 64;
+    size_t len = 0;
+    char *buf = arena_alloc(&source_arena, cap);
+    buf[0] = 0;
+
+    const char *p = input;
+    while (*p) {
+        if (isalnum(*p) || *p == '_') {
+            const char *start = p;
+            while (isalnum(*p) || *p == '_') p++;
+            size_t wlen = p - start;
+
+            Macro *m = find_macro_n(start, wlen);
+            const char *to_append = (m && m->body) ? m->body : start;
+            size_t append_len = (m && m->body) ? strlen(to_append) : wlen;
+
+            while (len + append_len >= cap) {
+                buf = arena_grow(&source_arena, buf, cap, cap * 2);
+                cap *= 2;
+            }
+            memcpy(buf + len, to_append, append_len);
+            len += append_len;
+            buf[len] = 0;
+        } else {
+            if (len + 1 >= cap) {
+                buf = arena_grow(&source_arena, buf, cap, cap * 2);
+                cap *= 2;
+            }
+            buf[len++] = *p++;
+            buf[len] = 0;
+        }
+    }
+    return buf;
+}
+
+static void process() {
+    int c;
+    while (1) {
+        if (tokens.head) arena_release(&tokens, (ArenaMark){0});
+        top_level_read = 1;
+        c = get_char();
+        top_level_read = 0;
+        if (c == EOF) break;
+        if (c == '/' && peek_char() == '*') {
+            get_char();
+            while (1) {
+                int n = get_char();
+                if (n == EOF) break;
+                if (n == '*' && peek_char() == '/') {
+                    get_char();
+                    break;
+                }
+            }
+            continue;
+        }
+
+        if (c == '{') {
+            skip_whitespace();
+            int next = peek_char();
+            if (strchr("LDU?Mx!CFS", next)) {
+                if (strchr("LDUCFS", next)) memo_fail(memo_stack);
+                if (next == 'L') {
+                    read_word();
+                    char *arg = read_path_until_brace();
+                    consume_until_brace();
+                    char *resolved = resolve_path(arg);
+                    if (resolved) {
+                        if (pch_recording) record_dep(arg, resolved);
+                        if (!load_pch(resolved)) push_file(resolved);
+                        free(resolved);
+                    }
+                    else { fprintf(stderr, "Error: Could not find file '%s'\n", arg); exit(1); }
+                } else if (next == 'S') {
+                    read_word();
+                    char *arg = read_path_until_brace();
+                    if (is_guarded(arg)) {
+                        pop_source();
+                    } else {
+                        add_guard(arg);
+                        consume_until_brace();
+                    }
+                } else if (next == 'D') {
+                    read_word();
+                    skip_whitespace();
+                    char *name = read_word();
+                    skip_whitespace();
+                    Pos at = text_pos();
+                    char *body = read_definition_body();
+                    define_macro(name, body);
+                    place_macro(name, at);
+                } else if (next == 'F') {
+                    read_word();
+                    skip_whitespace();
+                    char *name = read_word();
+                    int pcount = 0;
+                    char **params = read_decl_params(&pcount);
+                    skip_whitespace();
+                    Pos at = text_pos();
+                    char *body = read_definition_body();
+                    define_macro_base(name, body, params, pcount);
+                    place_macro(name, at);
+                } else if (next == 'U') {
+                    read_word(); skip_whitespace();
+                    char *name = read_word();
+                    undef_macro(name);
+                    consume_until_brace();
+                } else if (next == '?') {
+                    get_char(); skip_whitespace();
+                    char *name = read_word();
+                    print_macro_debug(name);
+                    consume_until_brace();
+                } else if (next == 'M') {
+                    get_char(); skip_whitespace();
+                    char *name = read_word();
+                    Macro *m = find_macro(name);
+                    consume_until_brace();
+                    if (m && m->body) {
+                        push_string(m->body);
+                        place_body(m, name, strlen(name));
+                    }
+                } else if (next == 'x') {
+                    get_char();
+                    skip_whitespace();
+                    long count = 0;
+                    while (isdigit(peek_char())) {
+                        count = count * 10 + (get_char() - '0');
+                    }
+                    skip_whitespace();
+                    if (get_char() != '{') { consume_until_brace(); continue; }
+                    char *raw_body = read_definition_body(); 
+                    consume_until_brace(); 
+                    if (count > 0 && raw_body && *raw_body) {
+                        ArenaMark mark = arena_mark(&source_arena);
+                        push_repeat(mark, expand_macros_once(raw_body), count);
+                    }
+                } else if (next == '!') {
+                    get_char(); skip_whitespace();
+                    char *name = read_word();
+                    char *comm = find_macro_comment(name);
+                    if (comm) print_sanitized_string(comm);
+                    else print_sanitized_string(name);
+                    consume_until_brace();
+                } else if (next == 'C') {
+                    read_word(); skip_whitespace();
+                    char *name = read_word();
+                    char *desc = read_definition_body();
+                    define_macro_comment(name, desc);
+                }
+            } else { get_char(); } 
+        }
+        else if (c == '}') { } 
+        else if (isalnum(c) || c == '_') {
+            src_stack->p--;
+            size_t wlen;
+            const char *word = scan_word(&wlen);
+            Macro *m = find_macro_n(word, wlen);
+            if (m) {
+                if (m->param_count > 0) {
+                    char **args = read_call_args(m->param_count);
+                    if (args) {
+                        ArenaMark mark = arena_mark(&source_arena);
+                        push_repeat(mark, substitute_args(m->body, m->params, args, m->param_count), 1);
+                        place_body(m, word, wlen);
+                    } else {
+                        emit_string(word); 
+                    }
+                } else if (!pch_recording && !locations && m->expansion && expansion_valid(m->expansion)) {
+                    Expansion *e = m->expansion;
+                    if (m->annotated) { emit_string("/*@"); emit_string(word); emit_string("*/"); }
+                    emit_span(e->text, e->len);
+                    if (m->annotated) emit_string("/*@*/");
+                    if (memo_stack && !memo_stack->failed)
+                        for (int i = 0; i < e->dep_count; i++) memo_dep(e->deps[i]);
+                } else if (m->body) {
+                    if (m->annotated) { emit_string("/*@"); emit_string(word); emit_string("*/"); }
+                    push_string(m->body);
+                    place_body(m, word, wlen);
+                    src_stack->annotated = m->annotated;
+                    if (!pch_recording && !locations) {
+                        Memo *memo = arena_alloc(&source_arena, sizeof(Memo));
+                        *memo = (Memo){m, src_stack, memo_text_len, memo_dep_len, 0, memo_stack};
+                        memo_stack = memo;
+                    }
+                }
+            } else {
+                if (locations && wlen == 1 && word[0] == '_') mark_location();
+                emit_string(word);
+            }
+        } else {
+            /* never between the characters of an EXT op */
+            if (locations && c && strchr("+-<>.,[]", c) && prev_char != '_' && !(prev_char == '?' && prev_char2 == '_')) mark_location();
+            emit_char(c);
+        }
+    }
+}
+
+void pp_run(const char *filename, PpSink out, void *ctx) {
+    sink = out;
+    sink_ctx = ctx;
+    push_file(filename);
+    process();
+    flush_output();
+}
+
+static void discard(const char *s, size_t n, void *ctx) {
+    (void)s; (void)n; (void)ctx;
+}
+
+static void reset_symbols() {
+    for (size_t i = 0; i < sym_cap; i++) {
+        Symbol *sym = symbols[i];
+        if (!sym) continue;
+        if (sym->macro) undef_macro(sym->name);
+        free(sym->name);
+        free(sym->path);
+        free(sym);
+    }
+    free(symbols);
+    symbols = NULL;
+    sym_cap = sym_count = 0;
+}
+
+void pp_write_pch(const char *header) {
+    reset_symbols();
+    pch_recording = 1;
+    captured_len = 0;
+    record_dep(NULL, header);
+    pp_run(header, discard, NULL);
+    write_pch(header);
+    for (int i = 0; i < dep_count; i++) { free(deps[i].arg); free(deps[i].path); }
+    dep_count = 0;
+    pch_recording = 0;
+    reset_symbols();
+}
+
+void pp_locations() {
+    locations = 1;
+}
+
+void pp_annotate(const char *const *names) {
+    for (; *names; names++) {
+        Symbol *sym = intern(*names);
+        sym->annotated = 1;
+        if (sym->macro) sym->macro->annotated = 1;
+    }
+}
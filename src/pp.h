@@ -0,0 +1,27 @@
+#ifndef PP_H
+#define PP_H
+
+#include <stddef.h>
+
+/* receives the preprocessed program in order, a line or part of one at a time */
+typedef void (*PpSink)(const char *s, size_t n, void *ctx);
+
+/* preprocess filename (stdin when NULL); exits on a missing file */
+void pp_run(const char *filename, PpSink out, void *ctx);
+
+/*
+ * bracket every expansion of the listed parameterless macros (NULL
+ * terminated) with origin marks: a comment "@NAME" before it and "@" after
+ */
+void pp_annotate(const char *const *names);
+
+/*
+ * mark where every op comes from with comments "#ID=PATH" naming a file
+ * and "#CF:CL TF:TL MACRO>..." before each op that starts a new origin
+ */
+void pp_locations(void);
+
+/* preprocess header on its own and save the result as header.bfpch for {LOAD} */
+void pp_write_pch(const char *header);
+
+#endif
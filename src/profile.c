@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bfc.h"
+
+/*
+ * Profiling. For --profile and --report the program is read with the
+ * pp_locations() marks, so every op carries its origin: the file and line
+ * it was written at, the macros it was expanded from and where its text
+ * is. The C for --profile counts, for every loop and if-block, how often
+ * it is reached and how often its body runs, and for loops the sum of the
+ * squared trip counts, which tells whether every entry ran the same number
+ * of times; every op's count follows from those of the loops around it.
+ * At exit the program writes them to bfc.prof ($BFC_PROFILE overrides)
+ * under a hash of the IR, and `bfc --report bfc.prof` or -fprofile-use
+ * with the same flags and source rebuild that IR and read them back.
+ */
+
+#define PROF_ROWS 20
+
+typedef struct {
+    int call_file, call_line;   /* line of a file at the top level */
+    int text_file, text_line;   /* where the text of the op is written */
+    char *macros;               /* "OUTER>...>INNER", empty outside macros */
+} Origin;
+
+static Origin *origins = NULL;
+static int origin_len = 0, origin_cap = 0;
+static char **files = NULL;
+static int file_len = 0;
+
+/* origin of the ops being read, 0 for none; see emit() */
+int prof_origin = 0;
+
+/* room for one more origin; origins[0] stands for none */
+static void origin_room(void) {
+    if (origin_len + 1 >= origin_cap) {
+        origin_cap = origin_cap ? origin_cap * 2 : 256;
+        origins = realloc(origins, sizeof(Origin) * origin_cap);
+    }
+    if (origin_len == 0) origins[origin_len++] = (Origin){-1, 0, -1, 0, ""};
+}
+
+/* a "#..." comment from pp_locations() */
+void prof_mark(const char *mark) {
+    char *end;
+    long id = strtol(mark, &end, 10);
+    if (end == mark || id < 0 || id > 1 << 20) return;
+    if (*end == '=') {
+        if (id >= file_len) {
+            files = realloc(files, sizeof(char *) * (id + 1));
+            while (file_len <= id) files[file_len++] = NULL;
+        }
+        free(files[id]);
+        files[id] = strdup(end + 1);
+        return;
+    }
+    Origin o = {0};
+    int n = 0;
+    if (sscanf(mark, "%d:%d %d:%d%n", &o.call_file, &o.call_line, &o.text_file, &o.text_line, &n) != 4) return;
+    o.macros = strdup(mark[n] == ' ' ? mark + n + 1 : "");
+    origin_room();
+    origins[origin_len] = o;
+    prof_origin = origin_len++;
+}
+
+/*
+ * src cut back to the expansion of macro: the origin of the native ops of
+ * an intrinsic, which is where the macro was called
+ */
+int prof_within(int src, const char *macro) {
+    if (src <= 0 || src >= origin_len) return src;
+    const char *m = origins[src].macros;
+    size_t len = strlen(macro);
+    for (const char *p = m; *p; ) {
+        size_t k = strcspn(p, ">");
+        if (k == len && memcmp(p, macro, len) == 0) {
+            if (!p[k]) return src;
+            Origin o = origins[src];
+            o.macros = strndup(m, p + k - m);
+            o.text_file = o.call_file;
+            o.text_line = o.call_line;
+            origin_room();
+            origins[origin_len] = o;
+            return origin_len++;
+        }
+        p += k + (p[k] == '>');
+    }
+    return src;
+}
+
+uint64_t ir_hash(void) {
+    uint64_t h = HASH_INIT;
+    for (int i = 0; i < ir_len; i++) {
+        int f[5] = {ir[i].type, ir[i].val, ir[i].val2, ir[i].off, ir[i].val3};
+        h = hash_bytes(h, f, sizeof(f));
+    }
+    return h;
+}
+
+/*
+ * bf_prof[3 * loop] counts arrivals at the loop, bf_prof[3 * loop + 1] runs
+ * of its body and bf_prof[3 * loop + 2] adds up the square of each trip
+ * count. It is written out by a destructor, so main() is the same with and
+ * without it; path is where it goes unless $BFC_PROFILE is set.
+ */
+void prof_put_runtime(FILE *out, int loops, const char *path) {
+    fprintf(out, "uint64_t bf_prof[%d];\n\n", 3 * loops + 1);
+    fprintf(out,
+        "__attribute__((destructor)) static void prof_dump(void) {\n"
+        "    const char *path = getenv(\"BFC_PROFILE\");\n"
+        "    FILE *f = fopen(path && *path ? path : ");
+    put_string(out, (const uint8_t *)path, strlen(path));
+    fprintf(out, ", \"w\");\n"
+        "    if (!f) return;\n"
+        "    fprintf(f, \"bfc-profile %016llx %d\\n\");\n"
+        "    for (int i = 0; i < %d; i += 3)\n"
+        "        fprintf(f, \"%%llu %%llu %%llu\\n\", (unsigned long long)bf_prof[i], (unsigned long long)bf_prof[i + 1], (unsigned long long)bf_prof[i + 2]);\n"
+        "    fclose(f);\n"
+        "}\n", (unsigned long long)ir_hash(), loops, 3 * loops);
+}
+
+/* the counts of every loop in t from path, NULL when they are not for this IR */
+uint64_t *prof_load(const char *path, const LoopTree *t) {
+    FILE *f = fopen(path, "r");
+    if (!f) { fprintf(stderr, "Error opening file: %s\n", path); return NULL; }
+    unsigned long long hash, a, b, c;
+    int loops, ok = fscanf(f, "bfc-profile %llx %d", &hash, &loops) == 2 && hash == ir_hash() && loops == t->len;
+    uint64_t *count = malloc(sizeof(uint64_t) * (3 * t->len + 1));
+    for (int i = 0; ok && i < t->len; i++) {
+        ok = fscanf(f, "%llu %llu %llu", &a, &b, &c) == 3;
+        count[3 * i] = a;
+        count[3 * i + 1] = b;
+        count[3 * i + 2] = c;
+    }
+    fclose(f);
+    if (ok) return count;
+    fprintf(stderr, "bfc: %s was not recorded from this program with these flags\n", path);
+    free(count);
+    return NULL;
+}
+
+/*
+ * Ops executed before each instruction: the cost of ir[a..b) is
+ * cost[b] - cost[a]. Ops outside every loop ran once.
+ */
+uint64_t *prof_costs(const LoopTree *t, const uint64_t *count) {
+    uint64_t *cost = malloc(sizeof(uint64_t) * (ir_len + 1));
+    int *open = malloc(sizeof(int) * (t->len + 1)), depth = 0;
+    cost[0] = 0;
+    for (int i = 0; i < ir_len; i++) {
+        int id = t->at[i];
+        uint64_t runs;
+        if (id >= 0 && t->loop[id].start == i) {
+            runs = count[3 * id];
+            open[depth++] = id;
+        } else if (id >= 0) {
+            runs = count[3 * id + 1];
+            depth--;
+        } else {
+            runs = depth ? count[3 * open[depth - 1] + 1] : 1;
+        }
+        cost[i + 1] = cost[i] + runs;
+    }
+    free(open);
+    return cost;
+}
+
+/* how often every entry to the loop ran its body, when that never varied; 0 otherwise */
+uint64_t prof_trip(const uint64_t *count, int loop) {
+    uint64_t in = count[3 * loop], iters = count[3 * loop + 1], squares = count[3 * loop + 2];
+    if (!in || iters % in || iters / in > UINT32_MAX) return 0;
+    uint64_t n = iters / in;
+    /* the squares add up to in * n * n exactly when every trip is n */
+    return squares % in == 0 && squares / in == n * n ? n : 0;
+}
+
+static const char *file_name(int id) {
+    return id >= 0 && id < file_len && files[id] ? files[id] : "?";
+}
+
+static void put_origin(FILE *out, int src) {
+    const Origin *o = &origins[src];
+    if (src == 0) { fprintf(out, "?\n"); return; }
+    fprintf(out, "%s:%d", file_name(o->call_file), o->call_line);
+    if (*o->macros) fprintf(out, " %s", o->macros);
+    if (o->text_file != o->call_file || o->text_line != o->call_line)
+        fprintf(out, " (%s:%d)", file_name(o->text_file), o->text_line);
+    fprintf(out, "\n");
+}
+
+typedef struct {
+    char *key;          /* macro name, or NULL to group by origin */
+    int src;
+    uint64_t ops;
+} Cost;
+
+static int same_origin(int a, int b) {
+    const Origin *x = &origins[a], *y = &origins[b];
+    return x->call_file == y->call_file && x->call_line == y->call_line && x->text_file == y->text_file
+        && x->text_line == y->text_line && strcmp(x->macros, y->macros) == 0;
+}
+
+static int cmp_group(const void *a, const void *b) {
+    const Cost *x = a, *y = b;
+    if (x->key) return strcmp(x->key, y->key);
+    const Origin *p = &origins[x->src], *q = &origins[y->src];
+    if (p->call_file != q->call_file) return p->call_file - q->call_file;
+    if (p->call_line != q->call_line) return p->call_line - q->call_line;
+    if (p->text_file != q->text_file) return p->text_file - q->text_file;
+    if (p->text_line != q->text_line) return p->text_line - q->text_line;
+    return strcmp(p->macros, q->macros);
+}
+
+static int cmp_cost(const void *a, const void *b) {
+    const Cost *x = a, *y = b;
+    return (x->ops < y->ops) - (x->ops > y->ops);
+}
+
+/* merge equal keys, then sort by cost */
+static int group(Cost *c, int n) {
+    qsort(c, n, sizeof(Cost), cmp_group);
+    int w = 0;
+    for (int i = 0; i < n; i++) {
+        if (w > 0 && (c[i].key ? strcmp(c[i].key, c[w - 1].key) == 0 : same_origin(c[i].src, c[w - 1].src))) {
+            c[w - 1].ops += c[i].ops;
+            free(c[i].key);
+        } else c[w++] = c[i];
+    }
+    qsort(c, w, sizeof(Cost), cmp_cost);
+    return w;
+}
+
+int prof_report(const char *path) {
+    LoopTree t;
+    loop_tree(&t);
+    uint64_t *count = prof_load(path, &t);
+    if (!count) { loop_tree_free(&t); return 1; }
+    origin_room();
+
+    /* executions of every op, and the running total */
+    uint64_t *sum = prof_costs(&t, count), total = sum[ir_len];
+    int *src = malloc(sizeof(int) * (ir_len + 1));
+    /* ops made up by the optimizer belong with the op before them */
+    for (int i = 0; i < ir_len; i++) src[i] = ir[i].src > 0 && ir[i].src < origin_len ? ir[i].src : i > 0 ? src[i - 1] : 0;
+    for (int i = ir_len - 1; i > 0; i--) if (!src[i - 1]) src[i - 1] = src[i];
+    printf("%llu ops executed\n", (unsigned long long)total);
+    double share = total ? 100.0 / total : 0;
+
+    Cost *c = malloc(sizeof(Cost) * (ir_len + t.len + 1));
+    int n = 0;
+    for (int k = 0; k < t.len; k++) {
+        const Loop *l = &t.loop[k];
+        if (ir[l->start].type != OP_JZ || l->end < 0) continue;
+        c[n++] = (Cost){NULL, k, sum[l->end + 1] - sum[l->start]};
+    }
+    qsort(c, n, sizeof(Cost), cmp_cost);
+    printf("\nhot loops:\n%14s %6s %12s %14s %10s  %s\n", "ops", "share", "entered", "iterations", "per entry", "origin");
+    for (int i = 0; i < n && i < PROF_ROWS && c[i].ops; i++) {
+        const Loop *l = &t.loop[c[i].src];
+        uint64_t in = count[3 * c[i].src], iters = count[3 * c[i].src + 1];
+        printf("%14llu %5.1f%% %12llu %14llu %10.1f  ", (unsigned long long)c[i].ops, c[i].ops * share,
+               (unsigned long long)in, (unsigned long long)iters, in ? (double)iters / in : 0.0);
+        put_origin(stdout, src[l->start]);
+    }
+
+    n = 0;
+    for (int i = 0; i < ir_len; i++) if (sum[i + 1] > sum[i]) c[n++] = (Cost){NULL, src[i], sum[i + 1] - sum[i]};
+    n = group(c, n);
+    printf("\nby origin:\n%14s %6s  %s\n", "ops", "share", "origin");
+    for (int i = 0; i < n && i < PROF_ROWS; i++) {
+        printf("%14llu %5.1f%%  ", (unsigned long long)c[i].ops, c[i].ops * share);
+        put_origin(stdout, c[i].src);
+    }
+
+    /* every macro an op was expanded from is charged once for it */
+    int cap = ir_len + 1;
+    n = 0;
+    for (int i = 0; i < ir_len; i++) {
+        const char *m = origins[src[i]].macros;
+        while (sum[i + 1] > sum[i] && *m) {
+            size_t len = strcspn(m, ">");
+            int seen = 0;
+            for (const char *p = origins[src[i]].macros; p < m && !seen; p += strcspn(p, ">") + 1)
+                seen = strcspn(p, ">") == len && memcmp(p, m, len) == 0;
+            if (!seen) {
+                if (n == cap) c = realloc(c, sizeof(Cost) * (cap *= 2));
+                c[n++] = (Cost){strndup(m, len), 0, sum[i + 1] - sum[i]};
+            }
+            m += len + (m[len] == '>');
+        }
+    }
+    n = group(c, n);
+    printf("\nby macro, including what it expands to:\n%14s %6s  %s\n", "ops", "share", "macro");
+    for (int i = 0; i < n && i < PROF_ROWS; i++)
+        printf("%14llu %5.1f%%  %s\n", (unsigned long long)c[i].ops, c[i].ops * share, c[i].key);
+    for (int i = 0; i < n; i++) free(c[i].key);
+
+    free(c);
+    free(sum);
+    free(src);
+    free(count);
+    loop_tree_free(&t);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bfc.h"
+
+/*
+ * Runtime helpers shared by the in-process backends (jit.c, interp.c).
+ * generate_c() emits the same kernels and I/O buffering into the generated
+ * program.
+ */
+
+/* bits of a 16-byte movemask that land on cells p, p+s, p+2s, ... */
+static unsigned stride_mask(int s) {
+    switch (s) {
+        case 1: case -1: return 0xFFFF;
+        case 2: return 0x5555;
+        case -2: return 0xAAAA;
+        case 4: return 0x1111;
+        case -4: return 0x8888;
+        case 8: return 0x0101;
+        case -8: return 0x8080;
+    }
+    return 0;
+}
+
+/*
+ * A scan that finds no zero runs off the tape: touch the cell just past
+ * the end it left by, so the guard reports it like any other stray access.
+ */
+static uint32_t scan_off(void *cells, int s) {
+    volatile uint8_t *edge = (uint8_t *)cells + (s < 0 ? -1 : (intptr_t)tape_size * CELL_BYTES);
+    (void)*edge;
+    return s < 0 ? 0 : tape_size - 1;
+}
+
+uint32_t rt_scan(void *cells, uint32_t p, int s) {
+    /* p wraps past UINT32_MAX when it leaves by the left end */
+    if (cell_bits != 8) {
+        while (cell_get(cells, p)) if ((p += s) >= tape_size) return scan_off(cells, s);
+        return p;
+    }
+    uint8_t *tape = cells;
+    if (s == 1) {
+        uint8_t *z = memchr(tape + p, 0, tape_size - p);
+        if (z) return z - tape;
+        p = tape_size - 1;
+    }
+#ifdef __GLIBC__
+    else if (s == -1) {
+        uint8_t *z = memrchr(tape, 0, p + 1);
+        if (z) return z - tape;
+        p = 0;
+    }
+#endif
+#ifdef __SSE2__
+    unsigned mask = stride_mask(s);
+    if (mask && s > 0) {
+        while (p + 16 <= tape_size) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(tape + p));
+            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & mask;
+            if (m) return p + __builtin_ctz(m);
+            p += 16;
+        }
+    } else if (mask) {
+        while (p >= 15) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(tape + p - 15));
+            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & mask;
+            if (m) return p - 15 + (31 - __builtin_clz(m));
+            p -= 16;
+        }
+    }
+#endif
+    while (tape[p]) if ((p += s) >= tape_size) return scan_off(cells, s);
+    return p;
+}
+
+/*
+ * Buffered I/O. Output collects in a buffer that goes out with write(2)
+ * when full, before input is read, and at exit; input is read in blocks.
+ */
+
+int rt_bufsize = 65536;
+static uint8_t *obuf, *ibuf;
+static size_t olen, ipos, ilen;
+
+void rt_io_init(void) {
+    obuf = malloc(rt_bufsize);
+    ibuf = malloc(rt_bufsize);
+    olen = ipos = ilen = 0;
+}
+
+void rt_flush(void) {
+    for (size_t done = 0; done < olen; ) {
+        ssize_t n = write(1, obuf + done, olen - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    olen = 0;
+}
+
+void rt_out(int c) {
+    obuf[olen++] = c;
+    if (olen == (size_t)rt_bufsize) rt_flush();
+}
+
+void rt_outs(const uint8_t *s, int n) {
+    while (n > 0) {
+        size_t k = rt_bufsize - olen < (size_t)n ? rt_bufsize - olen : (size_t)n;
+        memcpy(obuf + olen, s, k);
+        olen += k; s += k; n -= k;
+        if (olen == (size_t)rt_bufsize) rt_flush();
+    }
+}
+
+int rt_in(void) {
+    if (ipos == ilen) {
+        rt_flush();
+        ssize_t n = read(0, ibuf, rt_bufsize);
+        if (n <= 0) return -1;
+        ipos = 0;
+        ilen = n;
+    }
+    return ibuf[ipos++];
+}
+
+void rt_io_done(void) {
+    rt_flush();
+    free(obuf);
+    free(ibuf);
+}
+
+/*
+ * The tape lives between PROT_NONE guards (tape_guard() bytes each) in
+ * one reservation the kernel commits page by page. A fault inside the
+ * reservation is an access off the tape: the output so far is flushed and
+ * the run stops with a message instead of corrupting memory.
+ */
+static uintptr_t tape_lo, tape_hi;
+
+static void tape_fault(int sig, siginfo_t *si, void *ctx) {
+    static const char msg[] = "bfc: tape access out of range\n";
+    uintptr_t at = (uintptr_t)si->si_addr;
+    (void)ctx;
+    if (at < tape_lo || at >= tape_hi) { signal(sig, SIG_DFL); return; }
+    rt_flush();
+    if (write(2, msg, sizeof(msg) - 1) < 0) _exit(2);
+    _exit(1);
+}
+
+void *rt_tape_map(void) {
+    size_t guard = tape_guard(), size = (size_t)tape_size * CELL_BYTES;
+    uint8_t *p = mmap(NULL, size + 2 * guard, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED || mprotect(p + guard, size, PROT_READ | PROT_WRITE) != 0) {
+        perror("mmap");
+        exit(1);
+    }
+    tape_lo = (uintptr_t)p;
+    tape_hi = tape_lo + size + 2 * guard;
+    struct sigaction sa = {0};
+    sa.sa_sigaction = tape_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, NULL);
+    return p + guard;
+}
+
+void rt_tape_unmap(void) {
+    signal(SIGSEGV, SIG_DFL);
+    munmap((void *)tape_lo, tape_hi - tape_lo);
+}
@@ -0,0 +1,11 @@
+{D ONE +}
+{D TWO ONE ONE}
+{D SIX TWO TWO TWO}
+++++++++++++++++++++++++++++++++++++++++++++++++ SIX .
+{D ONE ++}
+[-]++++++++++++++++++++++++++++++++++++++++++++++++ SIX .
+{D TWO ONE}
+[-]++++++++++++++++++++++++++++++++++++++++++++++++ SIX .
+{U ONE}
+{D ONE +++}
+[-]++++++++++++++++++++++++++++++++++++++++++++++++ SIX .
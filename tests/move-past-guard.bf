@@ -0,0 +1 @@
+{x2000000{>}}+.
\ No newline at end of file
@@ -0,0 +1,3 @@
+{LOAD bfpp.bfh}
++++ PUSH > POP
+++++++++++++++++++++++++++++++++++++++++++++++++.
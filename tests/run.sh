@@ -0,0 +1,115 @@
+#!/bin/sh
+# Regression cases. Every NAME.bf here, and every guide/ program that
+# preprocesses, is built and run with each -O level and backend at each
+# cell width. Every run must print what the C backend prints at -O0 and
+# exit the same way, and so must `bfpp -R` output compiled with `bfc -R`.
+# At 8 bits that reference must match NAME.out when there is one; when
+# NAME.err exists every run must instead stop with status 1 and a message
+# containing that text.
+#
+# Then the compile cache and precompiled headers: a cache hit must give
+# the binary the miss built, a changed header must miss, and expanding with
+# .bfpch files must give what expanding without them does.
+cd "$(dirname "$0")" || exit 1
+BFC=${BFC:-$(pwd)/../src/bfc}
+PP=${PP:-$(pwd)/../src/bfpp}
+BFPP=${BFPP:-$(pwd)/../inc}
+export BFPP
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+modes="c i"
+[ "$(uname -m)" = x86_64 ] && modes="$modes jit asm"
+failed=0
+
+fail() {
+    echo "FAIL $*"
+    failed=1
+}
+
+# run MODE OPT SRC [FLAGS]: stdout in $tmp/out, stderr in $tmp/err, status in $rc
+run() {
+    run_mode=$1 run_opt=$2 run_src=$3
+    shift 3
+    case $run_mode in
+        c) "$BFC" --no-cache $run_opt "$@" "$run_src" -o "$tmp/prog" && "$tmp/prog" ;;
+        asm) "$BFC" --no-cache $run_opt --asm "$@" "$run_src" -o "$tmp/prog" && "$tmp/prog" ;;
+        i) "$BFC" $run_opt -i "$@" "$run_src" ;;
+        jit) "$BFC" $run_opt --jit "$@" "$run_src" ;;
+    esac < /dev/null > "$tmp/out" 2> "$tmp/err"
+    rc=$?
+}
+
+# same WHAT: the last run matches the reference
+same() {
+    [ $rc -eq $ref ] && cmp -s "$tmp/out" "$tmp/ref" || fail "$* (status $rc, want $ref)"
+    [ $want -eq 0 ] || grep -qF "$(cat "$name.err")" "$tmp/err" || fail "$* (message)"
+}
+
+for src in *.bf ../guide/*.bf; do
+    name=${src%.bf}
+    if ! "$BFC" -E "$src" > /dev/null 2>&1; then
+        echo "skip $src (does not preprocess)"
+        continue
+    fi
+    want=0
+    [ -f "$name.err" ] && want=1
+    "$PP" -R "$src" > "$tmp/prog.bfr"
+    for bits in 8 16 32; do
+        run c -O0 "$src" --cell-bits $bits
+        cp "$tmp/out" "$tmp/ref"
+        ref=$rc
+        [ $ref -eq $want ] || fail "$name -O0 c $bits bits (status $ref)"
+        [ $bits -eq 8 ] && [ -f "$name.out" ] && ! cmp -s "$tmp/ref" "$name.out" && fail "$name -O0 c (output)"
+        for opt in -O0 -O1 -O2 -O3; do
+            for mode in $modes; do
+                [ $opt$mode = -O0c ] && continue
+                run $mode $opt "$src" --cell-bits $bits
+                same "$name $opt $mode $bits bits"
+            done
+        done
+        run i -O0 "$tmp/prog.bfr" -R --cell-bits $bits
+        same "$name bfpp -R $bits bits"
+    done
+done
+
+# cache: miss, hit, then a miss for the changed header
+mkdir "$tmp/cache" "$tmp/hdr"
+export XDG_CACHE_HOME="$tmp/cache"
+printf '{D CH ++++++++++++++++++++++++++++++++++++++++++++++++}\n' > "$tmp/hdr/ch.bfh"
+printf '{LOAD ch.bfh}\nCH.\n' > "$tmp/hdr/prog.bf"
+# a miss stores a new file over the entry, a hit leaves its inode alone
+entries() { ls -i "$tmp/cache/bfc"; }
+(cd "$tmp/hdr" && "$BFC" -O prog.bf -o miss) || fail "cache build"
+before=$(entries)
+(cd "$tmp/hdr" && "$BFC" -O prog.bf -o hit) || fail "cache build"
+[ "$(entries)" = "$before" ] || fail "cache missed for an unchanged program"
+cmp -s "$tmp/hdr/miss" "$tmp/hdr/hit" || fail "cache hit differs from miss"
+[ "$("$tmp/hdr/hit")" = 0 ] || fail "cache hit output"
+printf '{D CH +++++++++++++++++++++++++++++++++++++++++++++++++}\n' > "$tmp/hdr/ch.bfh"
+(cd "$tmp/hdr" && "$BFC" -O prog.bf -o changed) || fail "cache build"
+[ "$("$tmp/hdr/changed")" = 1 ] || fail "cache hit for a changed header"
+unset XDG_CACHE_HOME
+
+# precompiled headers, fresh and then stale
+cp -r "$BFPP" "$tmp/inc"
+BFPP="$tmp/inc"
+for src in *.bf ../guide/*.bf; do "$PP" "$src" > "$tmp/$(basename "$src").plain" 2> /dev/null; done
+find "$tmp/inc" -name '*.bfh' -exec "$PP" --pch {} + || fail "bfpp --pch"
+[ -f "$tmp/inc/bfpp.bfh.bfpch" ] || fail "bfpp --pch wrote no bfpp.bfh.bfpch"
+for src in *.bf ../guide/*.bf; do
+    "$PP" "$src" 2> /dev/null | cmp -s - "$tmp/$(basename "$src").plain" || fail "$src with .bfpch"
+done
+printf '{D TONULL [+]}\n' >> "$tmp/inc/std/stdmacro.bfh"
+"$PP" ../guide/readability.bf > "$tmp/stale"
+find "$tmp/inc" -name '*.bfpch' -exec rm {} +
+"$PP" ../guide/readability.bf | cmp -s - "$tmp/stale" || fail "stale .bfpch used"
+cmp -s "$tmp/stale" "$tmp/readability.bf.plain" && fail "header change not seen"
+
+# bad option values are named, not just a failing status
+for opt in --cell-bits --tape-size --bufsize -j; do
+    "$BFC" $opt 0x opt-step.bf -i > /dev/null 2> "$tmp/err" && fail "$opt 0x accepted"
+    grep -qF -- "bad $opt value" "$tmp/err" || fail "$opt 0x (message)"
+done
+
+[ $failed -eq 0 ] && echo "all passed"
+exit $failed